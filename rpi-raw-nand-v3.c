@@ -30,11 +30,33 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
 
 // #define DEBUG 1
-
-#define PAGE_SIZE 2112 // (2K + 64)Byte
-#define BLOCK_SIZE 135168 // 64 pages (128K + 4K)Byte
+// data pin access: 0 = one pin at a time, 1 = lookup tables built from data_to_gpio_map at startup,
+// 2 = shifts and masks generated from NAND_IO0..7 at compile time
+#define DATA_BUS 2
+
+/* chip geometry, decoded from the ID by init_geometry or given with -g. until then it is the
+   2K page SLC one this tool started with: 2112 bytes per page (2K + 64), 64 pages per block */
+#define MAX_PAGE_SIZE (16384 + 2048)	// page buffers
+#define MIN_DATA_SIZE	2048	// smaller (512 byte) pages take other read commands and 4 address cycles
+struct nand_geometry {
+	int page_size;		// data + spare, what a page read clocks out
+	int data_size;		// also the first spare column
+	int pages_per_block;	// a power of 2
+	int block_size;		// page_size * pages_per_block
+	int blocks, luns;	// from a parameter page only, 0 when not known
+} geo = { 2112, 2048, 64, 135168, 0, 0 };
+int geometry_set = 0;	// -g given, the ID decode doesn't change it
+int small_page = 0;	// something said the chip has small pages, which this tool can't drive
+#define PAGE_SIZE	geo.page_size
+#define SPARE_COLUMN	geo.data_size
+#define PAGES_PER_BLOCK	geo.pages_per_block
+#define BLOCK_SIZE	geo.block_size
 #define MAX_WAIT_READ_BUSY	1000000
 
 /* For Raspberry B+ :*/
@@ -57,29 +79,241 @@
 #define N_WRITE_ENABLE		7
 //#define N_CHIP_ENABLE		22
 
-int data_to_gpio_map[8] = { 8, 9, 10, 11, 12, 13, 14, 15 }; // 8 is NAND IO 0, etc.
+#define NAND_IO0		8
+#define NAND_IO1		9
+#define NAND_IO2		10
+#define NAND_IO3		11
+#define NAND_IO4		12
+#define NAND_IO5		13
+#define NAND_IO6		14
+#define NAND_IO7		15
+
+int data_to_gpio_map[8] = { NAND_IO0, NAND_IO1, NAND_IO2, NAND_IO3, NAND_IO4, NAND_IO5, NAND_IO6, NAND_IO7 };
 
 volatile unsigned int *gpio;
 
+/* GPIO backends (-B): mem maps the BCM GPIO registers from /dev/mem (root, and the peripheral base
+   above has to match the Pi), chip goes through the gpiochip v2 character device: any SoC, no
+   root with the right group, but an ioctl per access. a whole data byte still moves in one
+   ioctl, the lines of a request being set and read together. sim is a NAND simulator (see
+   init_sim). every GPIO access goes through gpio_set/clear/write/levels and INP_GPIO/OUT_GPIO,
+   which pick the backend */
+#define GPIO_MEM	0
+#define GPIO_CHIP	1
+#define GPIO_SIM	2
+int gpio_backend = GPIO_MEM;
+unsigned long long sim_now = 0;	// sim: virtual time, ns
+void sim_bus(unsigned int mask, unsigned int values, int accesses);
+unsigned int sim_levels(void);
+
+#define GPIOCHIP_DEV	"/dev/gpiochip0"
+int gpio_line_fd = -1;		// chip backend line request
+int chip_pins[GPIO_V2_LINES_MAX], chip_lines;
+unsigned int chip_out_mask;	// GPIO mask of the lines that are outputs
+unsigned int chip_values;	// GPIO mask of the levels last written
+unsigned int chip_edge_mask;	// lines reporting rising edges (-w event)
+
+inline unsigned long long chip_bits(unsigned int mask)
+{
+	unsigned long long bits = 0;
+	int i;
+
+	for (i = 0; i < chip_lines; i++)
+		if (mask & (1u << chip_pins[i]))
+			bits |= 1ULL << i;
+	return bits;
+}
+
+inline unsigned int chip_mask(unsigned long long bits)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for (i = 0; i < chip_lines; i++)
+		if (bits & (1ULL << i))
+			mask |= 1u << chip_pins[i];
+	return mask;
+}
+
+// line flags: inputs by default, outputs (driving chip_values) and edge lines by attribute
+void chip_line_config(struct gpio_v2_line_config *c)
+{
+	struct gpio_v2_line_config_attribute *a = c->attrs;
+
+	memset(c, 0, sizeof(*c));
+	c->flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (chip_out_mask) {
+		a->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+		a->attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+		a++->mask = chip_bits(chip_out_mask);
+		a->attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		a->attr.values = chip_bits(chip_values);
+		a++->mask = chip_bits(chip_out_mask);
+	}
+	if (chip_edge_mask) {
+		a->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+		a->attr.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+		a++->mask = chip_bits(chip_edge_mask);
+	}
+	c->num_attrs = a - c->attrs;
+}
+
+void chip_reconfigure(void)
+{
+	struct gpio_v2_line_config c;
+
+	chip_line_config(&c);
+	if (ioctl(gpio_line_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &c) < 0) {
+		perror("gpiochip line config");
+		exit(1);
+	}
+}
+
+// request every pin this tool uses, all inputs until OUT_GPIO
+int init_gpio_chip(void)
+{
+	static const int control[] = { N_WRITE_PROTECT, N_READ_BUSY, ADDRESS_LATCH_ENABLE,
+		COMMAND_LATCH_ENABLE, N_READ_ENABLE, N_WRITE_ENABLE };
+	struct gpio_v2_line_request req;
+	int i, chip = open(GPIOCHIP_DEV, O_RDWR);
+
+	if (chip < 0) {
+		perror("open " GPIOCHIP_DEV);
+		return -1;
+	}
+	chip_lines = 0;
+	for (i = 0; i < 6; i++)
+		chip_pins[chip_lines++] = control[i];
+	for (i = 0; i < 8; i++)
+		chip_pins[chip_lines++] = data_to_gpio_map[i];
+	memset(&req, 0, sizeof(req));
+	for (i = 0; i < chip_lines; i++)
+		req.offsets[i] = chip_pins[i];
+	req.num_lines = chip_lines;
+	strcpy(req.consumer, "rpi-raw-nand");
+	chip_out_mask = chip_values = chip_edge_mask = 0;
+	chip_line_config(&req.config);
+	if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		perror("request GPIO lines from " GPIOCHIP_DEV);
+		close(chip);
+		return -1;
+	}
+	close(chip);
+	gpio_line_fd = req.fd;
+	return 0;
+}
+
+// values within mask, output lines only (the rest is kept for when they turn outputs)
+inline void chip_write(unsigned int mask, unsigned int values)
+{
+	struct gpio_v2_line_values v;
+
+	chip_values = (chip_values & ~mask) | (values & mask);
+	v.mask = chip_bits(mask & chip_out_mask);
+	v.bits = chip_bits(values);
+	if (v.mask && ioctl(gpio_line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0) {
+		perror("gpiochip set values");
+		exit(1);
+	}
+}
+
+inline unsigned int chip_read(void)
+{
+	struct gpio_v2_line_values v;
+
+	v.mask = (1ULL << chip_lines) - 1;
+	if (ioctl(gpio_line_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0) {
+		perror("gpiochip get values");
+		exit(1);
+	}
+	return chip_mask(v.bits);
+}
+
+inline void gpio_set(unsigned int mask)
+{
+	if (gpio_backend == GPIO_MEM)
+		*(gpio +  7) = mask;
+	else if (gpio_backend == GPIO_CHIP)
+		chip_write(mask, mask);
+	else
+		sim_bus(mask, mask, 1);
+}
+
+inline void gpio_clear(unsigned int mask)
+{
+	if (gpio_backend == GPIO_MEM)
+		*(gpio + 10) = mask;
+	else if (gpio_backend == GPIO_CHIP)
+		chip_write(mask, 0);
+	else
+		sim_bus(mask, 0, 1);
+}
+
+// pins in mask to values, one ioctl for the chip backend
+inline void gpio_write(unsigned int mask, unsigned int values)
+{
+	if (gpio_backend == GPIO_MEM) {
+		*(gpio +  7) = values & mask;
+		*(gpio + 10) = ~values & mask;
+	}
+	else if (gpio_backend == GPIO_CHIP)
+		chip_write(mask, values);
+	else
+		sim_bus(mask, values, 2);
+}
+
+inline unsigned int gpio_levels(void)
+{
+	if (gpio_backend == GPIO_MEM)
+		return *(gpio + 13);
+	return gpio_backend == GPIO_CHIP ? chip_read() : sim_levels();
+}
+
+// chip backend direction change of the pins in mask
+inline void chip_direction(unsigned int mask, int out)
+{
+	chip_out_mask = out ? chip_out_mask | mask : chip_out_mask & ~mask;
+	chip_reconfigure();
+}
+
 int read_id(unsigned char id[5]);
-int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare);
+int read_pages(int first_page_number, int number_of_pages, char *outfile, int column, int length);
 int write_pages(int first_page_number, int number_of_pages, char *infile);
 int erase_blocks(int first_block_number, int number_of_blocks);
+int flash_diff(int first_block_number, int number_of_blocks, char *infile);
+int scan_bbt(int first_block_number, int number_of_blocks, char *outfile);
+int set_geometry(int data_size, int spare_size, int pages_per_block);
+int init_wait_event(void);
+void print_wait_report(void);
+int read_status_byte();
+int init_geometry(void);
+int load_bbt(char *file);
+void init_ecc(void);
+int calibrate(int first_page_number, int number_of_pages, char *outfile);
+int bench_bus(int hardware);
+int init_sim(char *config);
 
 inline void INP_GPIO(int g)
 {
 #ifdef DEBUG
 	printf("setting direction of GPIO#%d to input\n", g);
 #endif
-	(*(gpio+((g)/10)) &= ~(7<<(((g)%10)*3)));
+	if (gpio_backend == GPIO_CHIP)
+		chip_direction(1u << g, 0);
+	else
+		(*(gpio+((g)/10)) &= ~(7<<(((g)%10)*3)));
 }
 
 inline void OUT_GPIO(int g)
 {
-	INP_GPIO(g);
 #ifdef DEBUG
 	printf("setting direction of GPIO#%d to output\n", g);
 #endif
+	if (gpio_backend == GPIO_CHIP) {
+		chip_direction(1u << g, 1);
+		return;
+	}
+	INP_GPIO(g);
 	*(gpio+((g)/10)) |= (1<<(((g)%10)*3));
 }
 
@@ -88,7 +322,7 @@ inline void GPIO_SET_1(int g)
 #ifdef DEBUG
 	printf("setting GPIO#%d to 1\n", g);
 #endif
-	*(gpio +  7)  = 1 << g;
+	gpio_set(1u << g);
 }
 
 inline void GPIO_SET_0(int g)
@@ -96,45 +330,183 @@ inline void GPIO_SET_0(int g)
 #ifdef DEBUG
 	printf("setting GPIO#%d to 0\n", g);
 #endif
-	*(gpio + 10)  = 1 << g;
+	gpio_clear(1u << g);
 }
 
 inline int GPIO_READ(int g)
 {
-	int x = (*(gpio + 13) & (1 << g)) >> g;
+	int x = (gpio_levels() >> g) & 1;
 #ifdef DEBUG
 	printf("GPIO#%d reads as %d\n", g, x);
 #endif
 	return x;
 }
 
+// data bus direction: GPFSEL images for "all data pins in" and "all data pins out" are taken once
+// the control pins are set up, a switch is then one plain store per GPFSEL register holding data
+// pins, and nothing at all when the bus already points the right way
+#define DATA_DIR_UNKNOWN	-1
+#define DATA_DIR_IN		0
+#define DATA_DIR_OUT		1
+
+int data_dir = DATA_DIR_UNKNOWN;
+unsigned int data_out_set[256];		// GPSET0 mask for each data byte (see init_data_bus)
+unsigned int data_out_clr[256];		// GPCLR0 mask for each data byte
+int data_dir_cached = 1;	// 0: read-modify-write each data pin on every switch
+unsigned int fsel_in[6], fsel_out[6];
+int fsel_used;			// bit n set: GPFSELn holds data pins
+
+void init_data_direction(void)
+{
+	int i, r, shift;
+
+	data_dir = DATA_DIR_UNKNOWN;
+	if (gpio_backend == GPIO_CHIP)	// no GPFSEL there
+		return;
+	fsel_used = 0;
+	for (i = 0; i < 8; i++)
+		fsel_used |= 1 << (data_to_gpio_map[i] / 10);
+	for (r = 0; r < 6; r++)
+		if (fsel_used & (1 << r))
+			fsel_in[r] = fsel_out[r] = *(gpio + r);
+	for (i = 0; i < 8; i++) {
+		r = data_to_gpio_map[i] / 10;
+		shift = (data_to_gpio_map[i] % 10) * 3;
+		fsel_in[r] &= ~(7 << shift);
+		fsel_out[r] = (fsel_out[r] & ~(7 << shift)) | (1 << shift);
+	}
+}
+
+inline void set_data_direction(int dir, unsigned int fsel[6])
+{
+	int i, r;
+
+	if (!data_dir_cached) {
+		for (i = 0; i < 8; i++) {
+			if (dir == DATA_DIR_OUT)
+				OUT_GPIO(data_to_gpio_map[i]);
+			else
+				INP_GPIO(data_to_gpio_map[i]);
+		}
+		return;
+	}
+	if (data_dir == dir)
+		return;
+	if (gpio_backend == GPIO_CHIP) {
+		chip_direction(data_out_set[0xff], dir == DATA_DIR_OUT);
+		data_dir = dir;
+		return;
+	}
+	for (r = 0; r < 6; r++)
+		if (fsel_used & (1 << r))
+			*(gpio + r) = fsel[r];
+	data_dir = dir;
+}
+
 inline void set_data_direction_in(void)
 {
-	int i;
 #ifdef DEBUG
 	printf("data direction => IN\n");
 #endif
-	for (i = 0; i < 8; i++)
-		INP_GPIO(data_to_gpio_map[i]);
+	set_data_direction(DATA_DIR_IN, fsel_in);
 }
 
 inline void set_data_direction_out(void)
 {
-	int i;
 #ifdef DEBUG
 	printf("data direction => OUT\n");
 #endif
-	for (i = 0; i < 8; i++)
-		OUT_GPIO(data_to_gpio_map[i]);
+	set_data_direction(DATA_DIR_OUT, fsel_out);
 }
 
-inline int GPIO_DATA8_IN(void)
+inline int data8_in_bits(void)
 {
 	int i, data;
 	for (i = data = 0; i < 8; i++, data = data << 1) {
 		data |= GPIO_READ(data_to_gpio_map[7 - i]);
 	}
-	data >>= 1;
+	return data >> 1;
+}
+
+inline void data8_out_bits(int data)
+{
+	int i;
+	for (i = 0; i < 8; i++, data >>= 1) {
+		if (data & 1)
+			GPIO_SET_1(data_to_gpio_map[i]);
+		else
+			GPIO_SET_0(data_to_gpio_map[i]);
+	}
+}
+
+// byte wide data bus: one GPSET0 + one GPCLR0 store per byte written, one GPLEV0 load per byte read
+unsigned char data_in_lane[4][256];	// GPLEV0 byte lane -> data bits it carries
+
+void init_data_bus(int map[8])
+{
+	int i, d;
+
+	memset(data_in_lane, 0, sizeof(data_in_lane));
+	for (d = 0; d < 256; d++) {
+		data_out_set[d] = data_out_clr[d] = 0;
+		for (i = 0; i < 8; i++) {
+			if (d & (1 << i))
+				data_out_set[d] |= 1u << map[i];
+			else
+				data_out_clr[d] |= 1u << map[i];
+			if (d & (1 << (map[i] % 8)))
+				data_in_lane[map[i] / 8][d] |= 1 << i;
+		}
+	}
+}
+
+inline int data8_in_table(void)
+{
+	unsigned int lev = gpio_levels();
+	return data_in_lane[0][lev & 0xff] | data_in_lane[1][(lev >> 8) & 0xff] |
+		data_in_lane[2][(lev >> 16) & 0xff] | data_in_lane[3][lev >> 24];
+}
+
+inline void data8_out_table(int data)
+{
+	gpio_write(data_out_set[0xff], data_out_set[data & 0xff]);
+}
+
+// compile-time pin map: data bit k moves to/from GPIO g through a constant rotation. runs of
+// consecutive pins share a rotation, which the compiler merges: a contiguous map becomes a single
+// shift and mask, a scattered one a short branchless permutation. no loops, no table loads
+#define ROR32(x, n)		(((x) >> (n)) | ((x) << ((32 - (n)) & 31)))
+#define PIN_TO_DATA(lev, k, g)	(ROR32(lev, ((g) - (k)) & 31) & (1u << (k)))
+#define DATA_TO_PIN(d, k, g)	(ROR32(d, ((k) - (g)) & 31) & (1u << (g)))
+#define DATA8_TO_PINS(d, io0, io1, io2, io3, io4, io5, io6, io7) \
+	(DATA_TO_PIN(d, 0, io0) | DATA_TO_PIN(d, 1, io1) | DATA_TO_PIN(d, 2, io2) | DATA_TO_PIN(d, 3, io3) | \
+	 DATA_TO_PIN(d, 4, io4) | DATA_TO_PIN(d, 5, io5) | DATA_TO_PIN(d, 6, io6) | DATA_TO_PIN(d, 7, io7))
+
+#define DEFINE_STATIC_BUS(name, io0, io1, io2, io3, io4, io5, io6, io7) \
+inline int name##_in(void) \
+{ \
+	unsigned int lev = gpio_levels(); \
+	return PIN_TO_DATA(lev, 0, io0) | PIN_TO_DATA(lev, 1, io1) | PIN_TO_DATA(lev, 2, io2) | \
+		PIN_TO_DATA(lev, 3, io3) | PIN_TO_DATA(lev, 4, io4) | PIN_TO_DATA(lev, 5, io5) | \
+		PIN_TO_DATA(lev, 6, io6) | PIN_TO_DATA(lev, 7, io7); \
+} \
+inline void name##_out(int data) \
+{ \
+	unsigned int d = data & 0xff, set = DATA8_TO_PINS(d, io0, io1, io2, io3, io4, io5, io6, io7); \
+	gpio_write(DATA8_TO_PINS(0xffu, io0, io1, io2, io3, io4, io5, io6, io7), set); \
+}
+
+DEFINE_STATIC_BUS(data8_static, NAND_IO0, NAND_IO1, NAND_IO2, NAND_IO3, NAND_IO4, NAND_IO5, NAND_IO6, NAND_IO7)
+
+inline int GPIO_DATA8_IN(void)
+{
+#if DATA_BUS == 2
+	int data = data8_static_in();
+#elif DATA_BUS == 1
+	int data = data8_in_table();
+#else
+	int data = data8_in_bits();
+#endif
 #ifdef DEBUG
 	printf("GPIO_DATA8_IN: data=%02x\n", data);
 #endif
@@ -143,54 +515,522 @@ inline int GPIO_DATA8_IN(void)
 
 inline void GPIO_DATA8_OUT(int data)
 {
-	int i;
 #ifdef DEBUG
 	printf("GPIO_DATA8_OUT: data=%02x\n", data);
 #endif
-	for (i = 0; i < 8; i++, data >>= 1) {
-		if (data & 1)
-			GPIO_SET_1(data_to_gpio_map[i]);
-		else
-			GPIO_SET_0(data_to_gpio_map[i]);
+#if DATA_BUS == 2
+	data8_static_out(data);
+#elif DATA_BUS == 1
+	data8_out_table(data);
+#else
+	data8_out_bits(data);
+#endif
+}
+
+/* NAND bus timing, all in ns. the asynchronous interface timing modes of the ONFI spec:
+   mode 0 (100ns cycle) is what every chip supports after power up, so it is the default */
+struct nand_timing {
+	int tCLS, tCLH, tALS, tALH, tDS, tDH, tWP, tWH;	// command/address/data input
+	int tRP, tREH, tREA, tRHW;			// data output
+	int tWB, tWHR, tADL, tRR;			// turnarounds
+};
+
+struct nand_timing onfi_timing_mode[6] = {
+	//  CLS CLH ALS ALH  DS  DH  WP  WH   RP REH REA RHW   WB WHR ADL  RR
+	{   50, 20, 50, 20, 40, 20, 50, 30,  50, 30, 40, 200, 200, 120, 200, 40 },
+	{   25, 10, 25, 10, 20, 10, 25, 15,  25, 15, 30, 100, 100,  80, 100, 20 },
+	{   15, 10, 15, 10, 15,  5, 17, 15,  17, 15, 25, 100, 100,  80, 100, 20 },
+	{   10,  5, 10,  5, 10,  5, 15, 10,  15, 10, 20, 100, 100,  60, 100, 20 },
+	{   10,  5, 10,  5, 10,  5, 12, 10,  12, 10, 20, 100, 100,  60,  70, 20 },
+	{   10,  5, 10,  5,  7,  5, 10,  7,  10,  7, 16, 100, 100,  60,  70, 20 },
+};
+
+struct nand_timing timing = onfi_timing_mode[0];
+int timing_scale = 100;	// percent of the timings above actually waited, from the command line
+int timing_mode = -1;	// -m, else the fastest one a parameter page lists, else 0
+
+// what each bus edge has to wait, in spin loop turns (see ndelay)
+struct {
+	unsigned int we_low;	// WE# low: setup of CLE/ALE/data to WE# rising, write pulse
+	unsigned int we_high;	// WE# high: hold of CLE/ALE/data, WE# high time
+	unsigned int re_low;	// RE# low to data valid, read pulse
+	unsigned int re_high;	// RE# high time
+	unsigned int rhw, wb, whr, adl, rr;
+} waits;
+
+unsigned int spins_per_us = 1000;	// ndelay() loop turns per microsecond, set by calibrate_ndelay()
+
+inline void spin(unsigned int n)
+{
+	volatile static unsigned int dontcare = 0;
+	if (gpio_backend == GPIO_SIM) { // a turn per ns, see calibrate_ndelay
+		sim_now += n;
+		return;
 	}
+	while (n--)
+		dontcare++;
+}
+
+inline unsigned int ns_to_spins(int ns)
+{
+	return ((unsigned long long)ns * timing_scale * spins_per_us + 100000 - 1) / 100000;
+}
+
+inline void ndelay(int ns)
+{
+	spin(ns_to_spins(ns));
 }
 
-int delay = 1;
-int shortpause()
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+void set_timing(struct nand_timing *t, int scale)
+{
+	timing = *t;
+	timing_scale = scale;
+	waits.we_low = ns_to_spins(MAX(MAX(timing.tWP, timing.tDS), MAX(timing.tCLS, timing.tALS)));
+	waits.we_high = ns_to_spins(MAX(MAX(timing.tWH, timing.tDH), MAX(timing.tCLH, timing.tALH)));
+	waits.re_low = ns_to_spins(MAX(timing.tRP, timing.tREA));
+	waits.re_high = ns_to_spins(timing.tREH);
+	waits.rhw = ns_to_spins(timing.tRHW);
+	waits.wb = ns_to_spins(timing.tWB);
+	waits.whr = ns_to_spins(timing.tWHR);
+	waits.adl = ns_to_spins(timing.tADL);
+	waits.rr = ns_to_spins(timing.tRR);
+}
+
+// count spin loop turns per microsecond against CLOCK_MONOTONIC_RAW. the CPU is kept busy a
+// while first so that cpufreq ramps up, and the fastest of a few runs is kept: should the clock
+// go up later on, waits get shorter than asked, so err on the fast side
+void calibrate_ndelay(void)
 {
+	struct timespec t0, t1;
+	unsigned long long ns, best = ~0ULL;
+	const unsigned int n = 1 << 20;
 	int i;
-	volatile static int dontcare = 0;
-	for (i = 0; i < delay; i++) {
-		dontcare++;
+
+	if (gpio_backend == GPIO_SIM) {
+		spins_per_us = 1000;
+		set_timing(&timing, timing_scale);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	do {
+		spin(n);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	} while ((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec) < 100000000);
+
+	for (i = 0; i < 5; i++) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+		spin(n);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+		if (ns < best)
+			best = ns;
+	}
+	spins_per_us = (unsigned long long)n * 1000 / (best ? best : 1) + 1;
+	set_timing(&timing, timing_scale);
+}
+
+/* adaptive timing (-a): slow down on a double read mismatch or a failed program/erase, speed up
+   again after a run of clean pages. never faster than the -a floor, nor than a timing that
+   already failed during this run */
+#define ADAPT_SLOWER		25	// percent added on an error
+#define ADAPT_FASTER		5	// percent removed after ADAPT_CLEAN_RUN clean operations
+#define ADAPT_CLEAN_RUN		64
+
+int adaptive_timing = 0;
+struct {
+	int floor, start, min, max;
+	int clean, slowdowns, speedups;
+} adapt;
+
+void start_adaptive_timing(void)
+{
+	adapt.start = adapt.min = adapt.max = timing_scale;
+	adapt.clean = adapt.slowdowns = adapt.speedups = 0;
+}
+
+void adapt_timing(int ok)
+{
+	int scale = timing_scale;
+
+	if (!adaptive_timing)
+		return;
+	if (!ok) {
+		if (adapt.floor <= scale)
+			adapt.floor = scale + 1;
+		scale += MAX(1, scale * ADAPT_SLOWER / 100);
+		adapt.clean = 0;
+		adapt.slowdowns++;
+		printf("\nTiming slowed down to %d%%\n", scale);
+	}
+	else if (++adapt.clean >= ADAPT_CLEAN_RUN) {
+		adapt.clean = 0;
+		scale = MAX(adapt.floor, scale - MAX(1, scale * ADAPT_FASTER / 100));
+		if (scale != timing_scale)
+			adapt.speedups++;
+	}
+	if (scale == timing_scale)
+		return;
+	set_timing(&timing, scale);
+	adapt.min = scale < adapt.min ? scale : adapt.min;
+	adapt.max = scale > adapt.max ? scale : adapt.max;
+}
+
+/* ID check policy (-i): the ID is read again to catch a moved clip every id_check_every pages
+   (1: before every page, PAGES_PER_BLOCK: once per block), or only after an error when 0 */
+int id_check_every = 1;
+int id_pages_since_check = 1;
+int id_checks = 0;
+double id_check_ns = 0;
+
+/* read verification (-v): double (default) reads every page twice and compares, ecc reads it once and
+   checks it against the 1 bit per 512 bytes Hamming ECC stored in the spare area, reading again only
+   pages with an uncorrectable sector. ECC layout is the Linux software ECC one: 3 bytes per 512 byte
+   sector, at the end of the spare area. register reads the page once from the array and clocks it
+   out twice from the page register (05h-E0h): no second tR, catches bus errors only */
+#define VERIFY_DOUBLE	0
+#define VERIFY_ECC	1
+#define VERIFY_REGISTER	2
+int verify_mode = VERIFY_DOUBLE;
+
+int cache_read = 0;	// -c, or the chip database: cache read sequences (31h/3Fh)
+int cache_program = 0;	// -c, or the chip database: cache program (15h)
+
+/* the part of the page register that page reads clock out, set by read_pages: they start there
+   through the column address or 05h-E0h and buffers hold only those bytes from their start */
+int read_column = 0, read_length = PAGE_SIZE;
+int multi_plane = 0;	// -p: two plane read, program and erase
+int direct_io = 0;	// -d: write the dump with O_DIRECT
+
+/* R/B# wait strategies (-w): poll spins on the GPIO level, sleep sleeps through most of a program
+   or erase (3/4 of the shortest one seen so far) and polls the rest, event sleeps on the rising
+   edge from the gpiochip character device, status polls RDY in the 70h status byte for boards
+   without R/B# wired. every wait has a timeout and goes into a histogram per operation */
+#define WAIT_POLL	0
+#define WAIT_SLEEP	1
+#define WAIT_EVENT	2
+#define WAIT_STATUS	3
+#define WAIT_READ	0	// tR
+#define WAIT_PROG	1	// tPROG
+#define WAIT_ERASE	2	// tBERS
+#define WAIT_CACHE	3	// tCBSY/tDBSY: 31h/3Fh, 15h, and the plane queueing 32h, 11h, D1h
+#define WAIT_OTHER	4	// parameter page, features
+#define WAIT_OPS	5
+#define WAIT_DATA	0x10	// or'ed into op: data output follows (WAIT_READ always), -w status goes back to it
+#define WAIT_BUCKETS	20	// log2 of microseconds
+int wait_strategy = WAIT_POLL;
+int wait_event_fd = -1;
+const char *wait_op_name[WAIT_OPS] = { "tR", "tPROG", "tBERS", "cache/plane", "other" };
+const int wait_timeout_us[WAIT_OPS] = { 50000, 50000, 500000, 50000, 50000 };
+struct {
+	int count;
+	double total_us, min_us, max_us;
+	int buckets[WAIT_BUCKETS];
+} wait_stats[WAIT_OPS];
+int skip_blank = 0;	// -s: don't program pages that are all 0xFF
+
+/* bad block table (scan_bbt, -b): "BBT1", first block and block count as native ints, then a
+   bit per block from the first one, set when the block is bad */
+#define BBT_MAGIC	"BBT1"
+unsigned char *bbt = NULL;
+int bbt_first, bbt_count;
+int bbt_skipped = 0;	// blocks a command left alone because of the table
+
+/* chip database (-k): a text file, one chip per line, loaded into buckets hashed on the first two
+   ID bytes. the longest entry matching the ID wins, 1 byte entries name the maker. see
+   CHIP_DB_FILE for the format */
+#define CHIP_DB_FILE		"nand-chips.txt"
+#define CHIP_DB_VERSION		2	// 2 added the quirks column, version 1 files still load
+#define CHIP_DB_BUCKETS		64
+#define CHIP_CACHE_READ		1
+#define CHIP_CACHE_PROGRAM	2
+#define CHIP_MULTI_PLANE	4
+#define CHIP_READ_RETRY		8
+#define CHIP_SMALL_PAGE		1	// quirk: 512 byte pages, other command set, refused
+
+struct chip_entry {
+	unsigned char id[5];
+	int id_len;
+	char maker[16], device[24];
+	int data_size, spare_size, pages_per_block;	// 0: decode the ID
+	int timing_mode;
+	int features;
+	int quirks;
+	struct chip_entry *next;
+};
+struct chip_entry *chip_db[CHIP_DB_BUCKETS];
+const char *chip_makers[256];
+char *chip_db_file = NULL;
+
+inline int chip_hash(unsigned char *id)
+{
+	return (id[0] * 31 + id[1]) % CHIP_DB_BUCKETS;
+}
+
+struct chip_entry *find_chip(unsigned char id[5])
+{
+	struct chip_entry *e, *best = NULL;
+
+	for (e = chip_db[chip_hash(id)]; e != NULL; e = e->next)
+		if (memcmp(e->id, id, e->id_len) == 0 && (best == NULL || e->id_len > best->id_len))
+			best = e;
+	return best;
+}
+
+// numbers or - for unknown
+inline int chip_db_number(char *s)
+{
+	return strcmp(s, "-") == 0 ? 0 : atoi(s);
+}
+
+int load_chip_db(char *file, int must_exist)
+{
+	char line[256], id[16], data[16], spare[16], pages[16], mode[16], features[128], quirks[128], *f;
+	struct chip_entry *e;
+	int n = 0, version = 0, line_no = 0, i;
+	FILE *db = fopen(file, "r");
+
+	if (db == NULL) {
+		if (must_exist) {
+			perror("fopen chip database");
+			return -1;
+		}
+		printf("No chip database %s (see -k): chips get no maker/device names, geometry from the ID only\n", file);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), db) != NULL) {
+		line_no++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+			continue;
+		if (sscanf(line, "version %d", &version) == 1) {
+			if (version < 1 || version > CHIP_DB_VERSION) {
+				printf("%s: version %d, this program reads version %d\n", file, version, CHIP_DB_VERSION);
+				fclose(db);
+				return -1;
+			}
+			continue;
+		}
+		e = (struct chip_entry *)calloc(1, sizeof(*e));
+		if (version == 0 || e == NULL ||
+		    sscanf(line, "%15s %15s %23s %15s %15s %15s %15s %127s %127s", id, e->maker, e->device,
+			   data, spare, pages, mode, features, quirks) != 8 + (version >= 2) ||
+		    strlen(id) % 2 != 0 || strlen(id) < 2 || strlen(id) > 10) {
+			printf("%s:%d: bad line (no version line before it?)\n", file, line_no);
+			fclose(db);
+			return -1;
+		}
+		e->id_len = strlen(id) / 2;
+		for (i = 0; i < e->id_len; i++)
+			sscanf(id + 2 * i, "%2hhx", &e->id[i]);
+		e->data_size = chip_db_number(data);
+		e->spare_size = chip_db_number(spare);
+		e->pages_per_block = chip_db_number(pages);
+		e->timing_mode = MIN(MAX(chip_db_number(mode), 0), 5);
+		for (f = strtok(features, ","); f != NULL; f = strtok(NULL, ","))
+			e->features |= strcmp(f, "cache_read") == 0 ? CHIP_CACHE_READ :
+				       strcmp(f, "cache_program") == 0 ? CHIP_CACHE_PROGRAM :
+				       strcmp(f, "multi_plane") == 0 ? CHIP_MULTI_PLANE :
+				       strcmp(f, "read_retry") == 0 ? CHIP_READ_RETRY : 0;
+		for (f = version >= 2 ? strtok(quirks, ",") : NULL; f != NULL; f = strtok(NULL, ","))
+			e->quirks |= strcmp(f, "small_page") == 0 ? CHIP_SMALL_PAGE : 0;
+		if (e->id_len == 1) {
+			chip_makers[e->id[0]] = e->maker;
+			continue;
+		}
+		e->next = chip_db[chip_hash(e->id)];
+		chip_db[chip_hash(e->id)] = e;
+		n++;
+	}
+	fclose(db);
+	printf("Chip database %s: %d chips\n", file, n);
+	return 0;
+}
+
+inline int block_is_bad(int block)
+{
+	block -= bbt_first;
+	return bbt != NULL && block >= 0 && block < bbt_count && (bbt[block / 8] >> (block % 8)) & 1;
+}
+
+double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// time as the bus sees it: CLOCK_MONOTONIC, or the simulator's virtual clock
+void bus_time(struct timespec *t)
+{
+	if (gpio_backend == GPIO_SIM) {
+		t->tv_sec = sim_now / 1000000000;
+		t->tv_nsec = sim_now % 1000000000;
 	}
+	else
+		clock_gettime(CLOCK_MONOTONIC, t);
 }
 
-// void shortpause()
-// {
-//     struct timespec ts;
-//     ts.tv_sec = delay / 1000;
-//     ts.tv_nsec = (delay % 1000) * 1000000;
-//     nanosleep(&ts, NULL);
-// }
+// end of run summary: wall clock throughput (bus time with -B sim), and what adaptive timing did
+void print_run_report(int count, const char *unit, long bytes_per_unit, struct timespec *start)
+{
+	struct timespec end;
+	double seconds;
+
+	bus_time(&end);
+	seconds = elapsed_ns(start, &end) / 1e9;
+	printf("Throughput:         %.1f %s/s (%.1f KB/s)\n", count / seconds, unit,
+		(double)count * bytes_per_unit / 1024 / seconds);
+	printf("ID checks:          %d, %.3f s (%.1f%% of the run)\n", id_checks, id_check_ns / 1e9,
+		id_check_ns / 1e7 / seconds);
+	if (adaptive_timing)
+		printf("Adaptive timing:    %d%% at start, %d%% at end (%d%%..%d%%), %d slowdowns, %d speedups\n",
+			adapt.start, timing_scale, adapt.min, adapt.max, adapt.slowdowns, adapt.speedups);
+	print_wait_report();
+}
 
 int main(int argc, char **argv)
 { 
-	int mem_fd;
+	int mem_fd = -1, opt, id_policy_set = 0, backend_set = 0;
+	char *prog = argv[0], *sim_config_file = NULL, *end;
+	FILE *f;
 
 	printf("Raspberry GPIO raw NAND flasher by pharos, littlebalup, skypiece\n\n");
 
-	if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
-		perror("open /dev/mem, are you root?");
+	while ((opt = getopt(argc, argv, "+a:b:B:cdg:i:k:m:psv:w:")) != -1) {
+		switch (opt) {
+		case 'a':
+			adaptive_timing = 1;
+			if ((adapt.floor = atoi(optarg)) <= 0) {
+				printf("-a: minimum timing must be > 0 %%\n");
+				return -1;
+			}
+			break;
+		case 'g':
+			if (sscanf(optarg, "%d,%d,%d", &geo.data_size, &opt, &geo.pages_per_block) != 3 ||
+			    set_geometry(geo.data_size, opt, geo.pages_per_block) < 0) {
+				printf("-g: <data bytes>,<spare bytes>,<pages per block>, e.g. 2048,64,64\n");
+				return -1;
+			}
+			geometry_set = 1;
+			break;
+		case 'i':
+			if (strcmp(optarg, "page") == 0)
+				id_check_every = 1;
+			else if (strcmp(optarg, "block") == 0)
+				id_check_every = -1; // PAGES_PER_BLOCK once it is known
+			else if (strcmp(optarg, "error") == 0)
+				id_check_every = 0;
+			else if ((id_check_every = atoi(optarg)) <= 0) {
+				printf("-i: page, block, error or a number of pages\n");
+				return -1;
+			}
+			id_pages_since_check = id_check_every;
+			id_policy_set = 1;
+			break;
+		case 'b':
+			if (load_bbt(optarg) < 0)
+				return -1;
+			break;
+		case 'B':
+			backend_set = 1;
+			if (strcmp(optarg, "mem") == 0)
+				gpio_backend = GPIO_MEM;
+			else if (strcmp(optarg, "chip") == 0)
+				gpio_backend = GPIO_CHIP;
+			else if (strncmp(optarg, "sim", 3) == 0 && (optarg[3] == 0 || optarg[3] == ':')) {
+				gpio_backend = GPIO_SIM;
+				sim_config_file = optarg[3] ? optarg + 4 : NULL;
+			}
+			else {
+				printf("-B: mem, chip or sim[:<config file>]\n");
+				return -1;
+			}
+			break;
+		case 'c':
+			cache_read = cache_program = 1;
+			break;
+		case 'd':
+			direct_io = 1;
+			break;
+		case 'k':
+			chip_db_file = optarg;
+			break;
+		case 'm':
+			if ((timing_mode = atoi(optarg)) < 0 || timing_mode > 5 || optarg[0] < '0' || optarg[0] > '9') {
+				printf("-m: timing mode 0 to 5\n");
+				return -1;
+			}
+			break;
+		case 'p':
+			multi_plane = 1;
+			break;
+		case 's':
+			skip_blank = 1;
+			break;
+		case 'v':
+			if (strcmp(optarg, "double") == 0)
+				verify_mode = VERIFY_DOUBLE;
+			else if (strcmp(optarg, "ecc") == 0)
+				verify_mode = VERIFY_ECC;
+			else if (strcmp(optarg, "register") == 0)
+				verify_mode = VERIFY_REGISTER;
+			else {
+				printf("-v: double, ecc or register\n");
+				return -1;
+			}
+			break;
+		case 'w':
+			if (strcmp(optarg, "poll") == 0)
+				wait_strategy = WAIT_POLL;
+			else if (strcmp(optarg, "sleep") == 0)
+				wait_strategy = WAIT_SLEEP;
+			else if (strcmp(optarg, "event") == 0)
+				wait_strategy = WAIT_EVENT;
+			else if (strcmp(optarg, "status") == 0)
+				wait_strategy = WAIT_STATUS;
+			else {
+				printf("-w: poll, sleep, event or status\n");
+				return -1;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	argv[0] = prog;
+	if (load_chip_db(chip_db_file != NULL ? chip_db_file : (char *)CHIP_DB_FILE, chip_db_file != NULL) < 0)
 		return -1;
+
+	if (argc == 3 && strcmp(argv[2], "bench_bus") == 0)
+		return bench_bus(backend_set ? gpio_backend : -1);
+
+	init_data_bus(data_to_gpio_map);
+	if (gpio_backend == GPIO_CHIP) {
+		if (init_gpio_chip() < 0)
+			return -1;
+	}
+	else if (gpio_backend == GPIO_SIM) {
+		if (init_sim(sim_config_file) < 0)
+			return -1;
 	}
+	else {
+		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
+			perror("open /dev/mem, are you root?");
+			return -1;
+		}
 
-	if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
-						MAP_SHARED|MAP_FIXED, mem_fd, GPIO_BASE)) == MAP_FAILED) {
-		perror("mmap GPIO_BASE");
-		close(mem_fd);
-		return -1;
+		if ((gpio = (volatile unsigned int *) mmap((caddr_t) 0x13370000, 4096, PROT_READ|PROT_WRITE,
+							MAP_SHARED|MAP_FIXED, mem_fd, GPIO_BASE)) == MAP_FAILED) {
+			perror("mmap GPIO_BASE");
+			close(mem_fd);
+			return -1;
+		}
 	}
 
+	init_ecc();
+
 	INP_GPIO(N_READ_BUSY);
 
 	OUT_GPIO(N_WRITE_PROTECT);
@@ -211,27 +1051,100 @@ int main(int argc, char **argv)
 	//OUT_GPIO(N_CHIP_ENABLE);
 	//GPIO_SET_0(N_CHIP_ENABLE);
 
+	init_data_direction();
+	if (wait_strategy == WAIT_EVENT && init_wait_event() < 0)
+		return -1;
+
 	if (argc < 3) {
 usage:
 		//GPIO_SET_1(N_CHIP_ENABLE);
-		printf("usage: sudo %s <delay> <command> ...\n\n" \
-		    " <delay> used to slow down operations (50 should work, increase if bad reads)\n\n" \
+		printf("usage: sudo %s [options] <timing> <command> ...\n\n" \
+		    " <timing> percent of the ONFI timing mode (see -m) NAND timings to wait, with the %% sign\n" \
+		    "          (100%% should work, increase if bad reads), or a file saved by calibrate.\n" \
+		    "          a plain number is refused: it was a spin loop count in older versions\n\n" \
+		    "Options:\n" \
+		    " -a <min timing> : adapt <timing> during the run, slower on errors, faster after clean pages,\n" \
+		    "                   never below <min timing> percent (e.g. 60%%)\n" \
+		    " -b <bbt file>   : skip the bad blocks listed in a table saved by scan_bbt (read commands\n" \
+		    "                   put 0xFF pages in their place)\n" \
+		    " -B <backend>    : GPIO access: mem (/dev/mem registers, default), chip (" GPIOCHIP_DEV ",\n" \
+		    "                   no root needed, slower) or sim[:<config file>] (no Pi nor NAND: a simulated\n" \
+		    "                   chip on virtual time, see nand-sim.txt)\n" \
+		    " -c              : cache read and program, pipelined page loads (31h/3Fh) and programs (15h)\n" \
+		    "                   when the chip does them right\n" \
+		    "                   (implies -i block unless -i is given)\n" \
+		    " -d              : write read_full/read_data dumps with O_DIRECT, bypassing the page cache\n" \
+		    "                   (read_data only, read_full pages are not a multiple of 512 bytes)\n" \
+		    " -g <d>,<s>,<p>  : page geometry: d data + s spare bytes per page, p pages per block\n" \
+		    "                   (default: decoded from the ID)\n" \
+		    " -i <policy>     : when to read the ID again to catch a moved clip: page (default), block,\n" \
+		    "                   error (only after a failed operation) or every <N> pages\n" \
+		    " -k <file>       : chip database (default: " CHIP_DB_FILE " if it exists), see that file\n" \
+		    " -m <mode>       : ONFI timing mode 0-5 <timing> is a percent of (default: the fastest one\n" \
+		    "                   the ONFI/JEDEC parameter page lists, 0 without one)\n" \
+		    " -p              : multi-plane read, program and erase of block pairs, when the ID reports\n" \
+		    "                   2 or more planes\n" \
+		    " -s              : write_full: skip pages that are all 0xFF (data and spare), the erased state\n" \
+		    " -w <strategy>   : how to wait for R/B#: poll (default), sleep (then poll, for program and\n" \
+		    "                   erase), event (gpiochip edge events) or status (70h, R/B# not wired)\n" \
+		    " -v <mode>       : read verification: double (read twice and compare, default), ecc\n" \
+		    "                   (read once, check the 1 bit/512 bytes Hamming ECC in the spare area)\n" \
+		    "                   or register (read once, clock the page register out twice: bus errors\n" \
+		    "                   only, no second tR)\n\n" \
 		    "Commands:\n" \
 		    " read_id (no arguments)                        : read and decrypt chip ID\n" \
 		    " read_full <page #> <# of pages> <output file> : read N pages including spare\n" \
-		    " read_data <page #> <# of pages> <output file> : read N pages, discard spare\n" \
+		    " read_data <page #> <# of pages> <output file> : read N pages without spare (not clocked out)\n" \
+		    " read_spare <page #> <# of pages> <output file>: read only the spare area of N pages\n" \
+		    " read_columns <page #> <# of pages> <column> <# of bytes> <output file>\n" \
+		    "                                               : read only bytes column.. of N pages\n" \
 		    " write_full <page #> <# of pages> <input file> : write N pages, including spare\n" \
 		    " write_data <page #> <# of pages> <input file> : write N pages, discard spare\n" \
-		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n\n" \
+		    " erase_blocks <block number> <# of blocks>     : erase N blocks\n" \
+		    " flash_diff <block #> <# of blocks> <image>     : erase and write only the blocks that differ\n" \
+		    "                                                 from the image (write_full layout), then verify\n" \
+		    " scan_bbt <block #> <# of blocks> <bbt file>   : read the factory bad block markers of N blocks\n" \
+		    "                                                 and save a bad block table for -b\n" \
+		    " calibrate <page #> <# of pages> [file]        : find the fastest stable <timing> reading N pages,\n" \
+		    "                                                 save it to file to pass the file as <timing>\n" \
+		    " bench_bus (no arguments)                      : check and time data bus code (no NAND needed).\n" \
+		    "                                                 GPIO pins only move with -B mem or -B chip\n\n" \
 		    "Notes:\n" \
-		    " This program assumes PAGE_SIZE == %d\n" \
-		    " Run as root (sudo) required (for /dev/mem access)\n\n",
-			argv[0], PAGE_SIZE);
+		    " Page and block sizes come from the ID (-g to override), %d byte pages at most\n" \
+		    " Run as root (sudo) required for /dev/mem access (-B mem)\n\n",
+			prog, MAX_PAGE_SIZE);
 		close(mem_fd);
 		return -1;
 	}
 
-	delay = atoi(argv[1]);
+	// "<n>%", a plain number is the spin loop <delay> of older versions (50 was suggested, half
+	// the timings now) and fails loudly instead
+	timing_scale = strtol(argv[1], &end, 10);
+	if (end != argv[1] && *end == 0) {
+		printf("timing %s: a plain number was the spin loop delay of older versions, give a percent of the\n"
+		       "NAND timings (%s%%, 100%% should work) or a file saved by calibrate\n", argv[1], argv[1]);
+		return -1;
+	}
+	if (end == argv[1] || strcmp(end, "%") != 0) {
+		timing_scale = 0;
+		if ((f = fopen(argv[1], "r")) != NULL) { // saved by calibrate
+			if (fscanf(f, "%d", &timing_scale) != 1)
+				timing_scale = 0;
+			fclose(f);
+		}
+	}
+	if (timing_scale <= 0) {
+		printf("timing must be a percent > 0, as 100%%, or a file saved by calibrate\n");
+		return -1;
+	}
+	calibrate_ndelay();
+	if (init_geometry() < 0)
+		return -1;
+	start_adaptive_timing();
+	if ((cache_read || cache_program) && !id_policy_set) // an ID check ends a cache sequence, which ends with the block anyway
+		id_check_every = -1;
+	if (id_check_every < 0)
+		id_check_every = id_pages_since_check = PAGES_PER_BLOCK;
 
 	if (strcmp(argv[2], "read_id") == 0) {
 		return read_id(NULL);
@@ -243,7 +1156,7 @@ usage:
 			printf("# of pages must be > 0\n");
 			return -1;
 		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 1);
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0, PAGE_SIZE);
 	}
 
 	if (strcmp(argv[2], "read_data") == 0) {
@@ -252,7 +1165,29 @@ usage:
 			printf("# of pages must be > 0\n");
 			return -1;
 		}
-		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0);
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], 0, SPARE_COLUMN);
+	}
+
+	if (strcmp(argv[2], "read_spare") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[5], SPARE_COLUMN, PAGE_SIZE - SPARE_COLUMN);
+	}
+
+	if (strcmp(argv[2], "read_columns") == 0) {
+		if (argc != 8) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		if (atoi(argv[5]) < 0 || atoi(argv[6]) <= 0 || atoi(argv[5]) + atoi(argv[6]) > PAGE_SIZE) {
+			printf("columns must be within the %d byte page\n", PAGE_SIZE);
+			return -1;
+		}
+		return read_pages(atoi(argv[3]), atoi(argv[4]), argv[7], atoi(argv[5]), atoi(argv[6]));
 	}
 
 	if (strcmp(argv[2], "write_full") == 0) {
@@ -273,21 +1208,50 @@ usage:
 		return erase_blocks(atoi(argv[3]), atoi(argv[4]));
 	}
 
-	printf("unknown command '%s'\n", argv[2]);
-	goto usage;
-	return 0;
-}
+	if (strcmp(argv[2], "flash_diff") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		return flash_diff(atoi(argv[3]), atoi(argv[4]), argv[5]);
+	}
 
-void error_msg(char *msg)
-{
-	printf("%s\nBe sure to check wiring, and check that pressure is applied on clip (if used)\n", msg);
-}
+	if (strcmp(argv[2], "scan_bbt") == 0) {
+		if (argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of blocks must be > 0\n");
+			return -1;
+		}
+		return scan_bbt(atoi(argv[3]), atoi(argv[4]), argv[5]);
+	}
+
+	if (strcmp(argv[2], "calibrate") == 0) {
+		if (argc != 5 && argc != 6) goto usage;
+		if (atoi(argv[4]) <= 0) {
+			printf("# of pages must be > 0\n");
+			return -1;
+		}
+		return calibrate(atoi(argv[3]), atoi(argv[4]), argc == 6 ? argv[5] : NULL);
+	}
+
+	printf("unknown command '%s'\n", argv[2]);
+	goto usage;
+	return 0;
+}
+
+void error_msg(char *msg)
+{
+	printf("%s\nBe sure to check wiring, and check that pressure is applied on clip (if used)\n", msg);
+}
 
 void print_id(unsigned char id[5])
 {
 	unsigned int i, bit, page_size, ras_size, orga, plane_number;
 	unsigned long block_size, plane_size, nand_size, nandras_size;
-	char maker[16], device[16], serial_access[20];
+	char serial_access[20];
+	const char *maker, *device;
+	struct chip_entry *chip;
 	unsigned *thirdbits = (unsigned*)malloc(sizeof(unsigned) * 8);
 	unsigned *fourthbits = (unsigned*)malloc(sizeof(unsigned) * 8);
 	unsigned *fifthbits = (unsigned*)malloc(sizeof(unsigned) * 8);
@@ -297,37 +1261,9 @@ void print_id(unsigned char id[5])
 		printf("0x%02X ", id[i]);
 	printf("\n");
 
- 	switch(id[0]) {
- 		case 0xEC: {
- 			strcpy(maker, "Samsung");
- 			switch(id[1]) {
- 				case 0xA1: strcpy(device, "K9F1G08R0A"); break;
- 				case 0xD5: strcpy(device, "K9GAG08U0M"); break;
- 				case 0xF1: strcpy(device, "K9F1G08U0A/B"); break;
- 				default: strcpy(device, "unknown");
- 			}
- 			break;
- 		}
- 		case 0xAD: {
- 			strcpy(maker, "Hynix");
- 			switch(id[1]) {
- 				case 0x73: strcpy(device, "HY27US08281A"); break;
- 				case 0xD7: strcpy(device, "H27UBG8T2A"); break;
- 				case 0xDA: strcpy(device, "HY27UF082G2B"); break;
- 				case 0xDC: strcpy(device, "H27U4G8F2D"); break;
- 				default: strcpy(device, "unknown");
- 			}
- 			break;
- 		}
- 		case 0x2C: {
- 			strcpy(maker, "Micron");
- 			switch(id[1]) {
- 				default: strcpy(device, "unknown");
- 			}
- 			break;
- 		}
- 		default: strcpy(maker, "unknown"); strcpy(device, "unknown");
- 	}
+	chip = find_chip(id);
+	maker = chip_makers[id[0]] != NULL ? chip_makers[id[0]] : chip != NULL ? chip->maker : "unknown";
+	device = chip != NULL ? chip->device : "unknown";
 
 /* all sizes in bytes */
 	for(bit = 0; bit < 8; ++bit)
@@ -418,48 +1354,27 @@ void print_id(unsigned char id[5])
 	printf("NAND size + RAS:    %lu MB\n", nandras_size / (1024 * 1024));
 	printf("Number of blocks:   %lu\n", nand_size / block_size);
 	printf("Number of pages:    %lu\n", nand_size / page_size);
+	if (chip != NULL && chip->data_size > 0)
+		printf("Chip database:      %d + %d bytes per page, %d pages per block, timing mode %d%s%s%s%s%s\n",
+			chip->data_size, chip->spare_size, chip->pages_per_block, chip->timing_mode,
+			chip->features & CHIP_CACHE_READ ? ", cache read" : "",
+			chip->features & CHIP_CACHE_PROGRAM ? ", cache program" : "",
+			chip->features & CHIP_MULTI_PLANE ? ", multi-plane" : "",
+			chip->features & CHIP_READ_RETRY ? ", read retry (not used)" : "",
+			chip->quirks & CHIP_SMALL_PAGE ? ", small page (not supported)" : "");
 }
 
-int read_id(unsigned char id[5])
+/* bus cycles: every edge waits only what the NAND timing for it asks (see set_timing) */
+inline void send_command(int cmd)
 {
-	int i;
-	unsigned char buf[5];
-
+	set_data_direction_out();
 	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
+	GPIO_DATA8_OUT(cmd);
 	GPIO_SET_0(N_WRITE_ENABLE);
-	set_data_direction_out(); GPIO_DATA8_OUT(0x90); // Read ID byte 1
-	shortpause();
+	spin(waits.we_low);
 	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();set_data_direction_in();
+	spin(waits.we_high);
 	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
-
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	GPIO_SET_0(N_WRITE_ENABLE);
-	set_data_direction_out(); GPIO_DATA8_OUT(0x00); // Read ID byte 2
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause(); set_data_direction_in();
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
-
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_READ_ENABLE);
-		shortpause();
-		buf[i] = GPIO_DATA8_IN(); //
-		GPIO_SET_1(N_READ_ENABLE);
-		shortpause();
-	}
-	if (id != NULL)
-		memcpy(id, buf, 5);
-	else
-		print_id(buf);
-	if (buf[0] == buf[1] && buf[1] == buf[2] && buf[2] == buf[3] && buf[3] == buf[4]) {
-		error_msg((char*)"all five ID bytes are identical, this is not normal");
-		return -1;
-	}
-	return 0;
 }
 
 inline int page_to_address(int page, int address_byte_index)
@@ -476,464 +1391,1161 @@ inline int page_to_address(int page, int address_byte_index)
 	}
 }
 
-int send_read_command(int page)
+// address cycles first..last - 1 of page (0, 1: column, 2, 3, 4: row)
+inline void send_address(int page, int first, int last)
 {
 	int i;
 
 	set_data_direction_out();
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x00);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
-
 	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
-
-
-		// if (i < 2) {
-		// 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		// }
-		// else {
-		// 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		// }
-
+	for (i = first; i < last; i++) {
 		GPIO_DATA8_OUT(page_to_address(page, i));
-		shortpause();
+		GPIO_SET_0(N_WRITE_ENABLE);
+		spin(waits.we_low);
 		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
+		spin(waits.we_high);
 	}
 	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
+}
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
+// one address cycle, ALE already high
+inline void send_address_byte(int byte)
+{
+	GPIO_DATA8_OUT(byte & 0xff);
 	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x30);
-	shortpause();
+	spin(waits.we_low);
 	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
-
-	return 0;
+	spin(waits.we_high);
 }
 
-int send_write_command(int page, unsigned char data[PAGE_SIZE])
+// all 5 address cycles, starting at column instead of 0
+inline void send_column_address(int page, int column)
 {
 	int i;
 
 	set_data_direction_out();
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x80);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
-
 	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 0; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-
-		// if (i < 2) {
-		// 	printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
-		// }
-		// else {
-		// 	printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
-		// }
-
-		GPIO_DATA8_OUT(page_to_address(page, i));
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
-	}
+	for (i = 0; i < 5; i++)
+		send_address_byte(i < 2 ? column >> (8 * i) : page_to_address(page, i));
 	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
+}
 
-	for (i = 0; i < PAGE_SIZE; i++) {
+inline void write_bytes(unsigned char *data, int n)
+{
+	int i;
+
+	set_data_direction_out();
+	for (i = 0; i < n; i++) {
+		GPIO_DATA8_OUT(data[i]);
 		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
-		GPIO_DATA8_OUT(data[i]); //
-		shortpause();
+		spin(waits.we_low);
 		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
+		spin(waits.we_high);
 	}
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause(); GPIO_SET_0(N_WRITE_ENABLE);
-	GPIO_DATA8_OUT(0x10);
-	shortpause(); GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause(); GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
-
-	return 0;
 }
 
-int send_eraseblock_command(int block)
+inline void read_bytes(unsigned char *data, int n)
 {
 	int i;
 
-	set_data_direction_out();
-
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0x60);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+	set_data_direction_in();
+	for (i = 0; i < n; i++) {
+		GPIO_SET_0(N_READ_ENABLE);
+		spin(waits.re_low);
+		data[i] = GPIO_DATA8_IN();
+		GPIO_SET_1(N_READ_ENABLE);
+		spin(waits.re_high);
+	}
+	spin(waits.rhw);	// before the next WE# low
+}
 
-	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
-	for (i = 2; i < 5; i++) {
-		GPIO_SET_0(N_WRITE_ENABLE);
-		shortpause();
+// rising edges of R/B# as events on a file descriptor, for -w event
+int init_wait_event(void)
+{
+	struct gpio_v2_line_request req;
+	int chip;
 
-		// printf("Row Add%d = %d\n", i - 1, page_to_address(block, i));
+	if (gpio_backend == GPIO_SIM) {
+		printf("-w event: not with the simulator, use poll, sleep or status\n");
+		return -1;
+	}
+	if (gpio_backend == GPIO_CHIP) { // R/B# is in the chip backend request already
+		chip_edge_mask = 1u << N_READ_BUSY;
+		chip_reconfigure();
+		wait_event_fd = gpio_line_fd;
+		return 0;
+	}
+	chip = open(GPIOCHIP_DEV, O_RDONLY);
 
-		GPIO_DATA8_OUT(page_to_address(block, i));
-		shortpause();
-		GPIO_SET_1(N_WRITE_ENABLE);
-		shortpause();
+	if (chip < 0) {
+		perror("open " GPIOCHIP_DEV);
+		return -1;
 	}
-	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
-	shortpause();
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = N_READ_BUSY;
+	req.num_lines = 1;
+	strcpy(req.consumer, "rpi-raw-nand R/B#");
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+	if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		perror("request R/B# line events");
+		close(chip);
+		return -1;
+	}
+	close(chip);
+	wait_event_fd = req.fd;
+	return 0;
+}
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause();
-	GPIO_SET_0(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_DATA8_OUT(0xD0);
-	shortpause();
-	GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause();
-	GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+inline int chip_ready(void)
+{
+	return GPIO_READ(N_READ_BUSY) != 0;
+}
 
-	return 0;
+inline double since_us(struct timespec *start)
+{
+	struct timespec now;
+
+	bus_time(&now);
+	return elapsed_ns(start, &now) / 1000;
 }
 
-int read_status()
+/* a chip that stays busy past the op timeout is gone (clip off, dead part): every wait after
+   that fails at once, and the commands stop at the next page or block through their usual exit,
+   read_pages with everything read so far in the dump */
+int bus_timed_out = 0;
+
+void wait_timed_out(int op, int status)
 {
-	int i, data;
-	unsigned char buf[5];
+	bus_timed_out = 1;
+	printf("\nTimeout: the chip stayed busy for more than %d ms (%s)\n", wait_timeout_us[op] / 1000, wait_op_name[op]);
+	error_msg((char*)(status ? "the status register never showed ready" :
+		"R/B# never went high. check its pull-up, or use -w status when it is not wired"));
+}
 
-	set_data_direction_out();
+/* wait for the chip after a command that makes it busy, op says which kind of busy. -1 when it
+   stays busy past the op timeout (see bus_timed_out) */
+int wait_ready(int op)
+{
+	struct timespec start;
+	struct pollfd pfd;
+	struct gpio_v2_line_event event;
+	double us;
+	int status, i, left, data = op == WAIT_READ || (op & WAIT_DATA);
+
+	op &= ~WAIT_DATA;
+	if (bus_timed_out)
+		return -1;
+	spin(waits.wb);
+	bus_time(&start);
+	switch (wait_strategy) {
+	case WAIT_SLEEP:
+		if ((op == WAIT_PROG || op == WAIT_ERASE) && wait_stats[op].count > 0) {
+			if (gpio_backend == GPIO_SIM)
+				sim_now += (unsigned long long)(wait_stats[op].min_us * 3 / 4 * 1000);
+			else
+				usleep((useconds_t)(wait_stats[op].min_us * 3 / 4));
+		}
+		// fall through
+	case WAIT_POLL:
+		while (!chip_ready())
+			if (since_us(&start) > wait_timeout_us[op])
+				goto timed_out;
+		break;
+	case WAIT_EVENT:
+		pfd.fd = wait_event_fd;
+		pfd.events = POLLIN;
+		// edges of earlier waits may still be queued, only the level counts
+		while (!chip_ready()) {
+			left = wait_timeout_us[op] - (int)since_us(&start);
+			if (left <= 0)
+				goto timed_out;
+			if (poll(&pfd, 1, left / 1000 + 1) > 0 && read(wait_event_fd, &event, sizeof(event)) < 0) {
+				perror("read R/B# event");
+				exit(1);
+			}
+		}
+		break;
+	case WAIT_STATUS:
+		while (((status = read_status_byte()) & 0x40) == 0)
+			if (since_us(&start) > wait_timeout_us[op])
+				goto timed_out;
+		if (data) {
+			send_command(0x00); // back from status to data output
+			spin(waits.whr);
+		}
+		break;
+	}
+	us = since_us(&start);
+	spin(waits.rr);
+
+	wait_stats[op].count++;
+	wait_stats[op].total_us += us;
+	if (wait_stats[op].count == 1 || us < wait_stats[op].min_us)
+		wait_stats[op].min_us = us;
+	if (us > wait_stats[op].max_us)
+		wait_stats[op].max_us = us;
+	for (i = 0; i < WAIT_BUCKETS - 1 && us >= (2 << i); i++)
+		;
+	wait_stats[op].buckets[i]++;
+	return 0;
 
-	GPIO_SET_1(COMMAND_LATCH_ENABLE);
-	shortpause(); GPIO_SET_0(N_WRITE_ENABLE);
-	GPIO_DATA8_OUT(0x70);
-	shortpause(); GPIO_SET_1(N_WRITE_ENABLE);
-	shortpause(); GPIO_SET_0(COMMAND_LATCH_ENABLE);
-	shortpause();
+timed_out:
+	wait_timed_out(op, wait_strategy == WAIT_STATUS);
+	return -1;
+}
 
-	set_data_direction_in();
+/* wait for status ARDY (bit 5), the array done with a cache read or program running in the
+   background. op gives the timeout. returns the status byte, -1 on a timeout */
+int wait_array_ready(int op)
+{
+	struct timespec start;
+	int status;
 
-	GPIO_SET_0(N_READ_ENABLE);
-	shortpause();
-	data = GPIO_DATA8_IN(); //
-	shortpause();
-	GPIO_SET_1(N_READ_ENABLE);
-	shortpause();
+	if (bus_timed_out)
+		return -1;
+	bus_time(&start);
+	while (((status = read_status_byte()) & 0x20) == 0)
+		if (since_us(&start) > wait_timeout_us[op]) {
+			wait_timed_out(op, 1);
+			return -1;
+		}
+	return status;
+}
 
-	// printf("Status data = %d\n", data);
+void print_wait_report(void)
+{
+	int op, i, last;
 
-	return data & 1; // I/O0=0 success , I/O0=1 error
+	for (op = 0; op < WAIT_OPS; op++) {
+		if (wait_stats[op].count == 0)
+			continue;
+		printf("Wait %s:%*s%d, %.1f us avg (%.1f..%.1f us), histogram:", wait_op_name[op],
+			(int)(14 - strlen(wait_op_name[op])), "", wait_stats[op].count,
+			wait_stats[op].total_us / wait_stats[op].count, wait_stats[op].min_us, wait_stats[op].max_us);
+		for (last = WAIT_BUCKETS - 1; last > 0 && wait_stats[op].buckets[last] == 0; last--)
+			;
+		for (i = 0; i <= last; i++)
+			if (wait_stats[op].buckets[i])
+				printf(" <%dus:%d", 2 << i, wait_stats[op].buckets[i]);
+		printf("\n");
+	}
 }
 
+void read_id_bytes(unsigned char buf[5])
+{
+	send_command(0x90);
+	send_address(0, 0, 1);
+	spin(waits.whr);
+	read_bytes(buf, 5);
+}
 
-int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+int read_id(unsigned char id[5])
 {
-	int page, page_no, block_no, page_nbr, percent, i, n, retry_count;
-	unsigned char id[5], id2[5];
-	unsigned char buf[PAGE_SIZE * 2];
-	FILE *badlog, *f = fopen(outfile, "w+");
-	if (f == NULL) {
-		perror("fopen output file");
+	unsigned char buf[5];
+
+	read_id_bytes(buf);
+	if (id != NULL)
+		memcpy(id, buf, 5);
+	else
+		print_id(buf);
+	if (buf[0] == buf[1] && buf[1] == buf[2] && buf[2] == buf[3] && buf[3] == buf[4]) {
+		error_msg((char*)"all five ID bytes are identical, this is not normal");
 		return -1;
 	}
-	if ((badlog = fopen("bad.log", "w+")) == NULL) {
-		perror("fopen bad.log");
+	return 0;
+}
+
+// 0 when the sizes make sense for this tool
+int set_geometry(int data_size, int spare_size, int pages_per_block)
+{
+	if (data_size >= 512 && data_size < MIN_DATA_SIZE) {
+		printf("%d byte pages: small page chips (00h/01h/50h reads, 4 address cycles) are not supported\n",
+			data_size);
+		small_page = 1;
 		return -1;
 	}
-	if (GPIO_READ(N_READ_BUSY) == 0) {
-		error_msg((char*)"N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+	if (data_size < MIN_DATA_SIZE || data_size % 512 != 0 || spare_size < 0 || spare_size % 8 != 0 ||
+	    data_size + spare_size > MAX_PAGE_SIZE ||
+	    pages_per_block < 2 || (pages_per_block & (pages_per_block - 1)) != 0)
 		return -1;
-	}
+	geo.page_size = data_size + spare_size;
+	geo.data_size = data_size;
+	geo.pages_per_block = pages_per_block;
+	geo.block_size = geo.page_size * pages_per_block;
+	read_column = 0;	// whole pages until read_pages says otherwise
+	read_length = geo.page_size;
+	return 0;
+}
 
-	if (read_id(id) < 0)
-		return -1;
-	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
+// geometry from the chip database, else from the 4th ID byte as print_id shows it, 0 when it makes sense
+int decode_geometry(unsigned char id[5])
+{
+	int data_size, spare_size, pages_per_block;
+	struct chip_entry *chip = find_chip(id);
+
+	if (chip != NULL && chip->data_size > 0)
+		return set_geometry(chip->data_size, chip->spare_size, chip->pages_per_block);
+	data_size = 1024 << (id[3] & 3);
+	spare_size = (8 << ((id[3] >> 2) & 1)) * (data_size / 512);
+	pages_per_block = (64 * 1024 << ((id[3] >> 4) & 3)) / data_size;
+	return set_geometry(data_size, spare_size, pages_per_block);
+}
 
-	printf("\nStart reading...\n");
-	clock_t start = clock();
+/* ONFI and JEDEC parameter pages: 90h 20h reads "ONFI", 90h 40h "JEDEC" on chips that have one,
+   then ECh with the same address loads it: 256 bytes (ONFI) or 512 (JEDEC), CRC-16 (poly 8005h,
+   init 4F4Eh) over all but the last 2 in those, and at least 3 copies of it in a row for when one
+   reads bad */
+#define PARAM_PAGE_SIZE		512	// the larger of the two
+#define PARAM_PAGE_COPIES	3
+#define PARAM_ONFI		0x20
+#define PARAM_JEDEC		0x40
 
+inline int param_page_size(int kind)
+{
+	return kind == PARAM_ONFI ? 256 : 512;
+}
 
-	for (retry_count = 0, page = first_page_number*2; page < (first_page_number + number_of_pages)*2; page++) {
+int param_page_crc(unsigned char *p, int size)
+{
+	int i, bit, crc = 0x4F4E;
 
-	  retry_all:
-		page_no = page >> 1;
+	for (i = 0; i < size - 2; i++) {
+		crc ^= p[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1) & 0xffff;
+	}
+	return crc;
+}
 
-		// printf("page = %d, n = %d\n",page, n);
+inline int le16(unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
 
-		if (page % 2 == 0 && retry_count == 0) {
-			// page_no = page / 2;
-			page_nbr = page_no - first_page_number + 1;
-			percent = (100 * page_nbr) / number_of_pages;
-			block_no = page_no / 64;
-			printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\r", page_no, block_no, page_nbr, number_of_pages, percent);
-			fflush(stdout);
-		}
-		// else {
-		// 	printf("Reading the page again to ensure correct operation\n");
-		// }
-
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
-		}
-		send_read_command(page_no);
-		//for (i = 0; i < MAX_WAIT_READ_BUSY; i++) {
-		//	if (GPIO_READ(N_READ_BUSY) == 0)
-		//		break;
-		//}
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
-		// if (i == MAX_WAIT_READ_BUSY) {
-		// 	// #ifdef DEBUG
-		// 		printf("N_READ_BUSY was not brought to 0 by NAND in time, retrying\n");
-		// 	// #endif
-		// 	goto retry;
-		// }
-		set_data_direction_in();
-		// for (i = 0; i < MAX_WAIT_READ_BUSY; i++) {
-		// 	if (GPIO_READ(N_READ_BUSY) == 1)
-		// 		break;
-		// }
-		// if (i == MAX_WAIT_READ_BUSY) {
-		// 	// #ifdef DEBUG
-		// 		printf("N_READ_BUSY was not brought to 1 by NAND in time, retrying\n");
-		// 	// #endif
-		// 	goto retry;
-		// }
-		n = PAGE_SIZE*(page & 1);
-		for (i = 0; i < PAGE_SIZE; i++) {
-			GPIO_SET_0(N_READ_ENABLE);
-			shortpause();
-			buf[i + n] = GPIO_DATA8_IN(); //
-			GPIO_SET_1(N_READ_ENABLE);
-			shortpause();
-		}
-		if (!n) // read the page again to ensure correct operation, bit 0 in page used for this purpose
-			// printf("RE LOOP    | page = %d, n = %d\n",page, n);
-			// printf("Reading the page n° %d again to ensure correct operation\n", page_no);
+inline int le32(unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+// PARAM_ONFI or PARAM_JEDEC, with the first good copy of its parameter page in p, 0 when neither
+int read_param_page(unsigned char p[PARAM_PAGE_SIZE])
+{
+	static const struct { int address; const char *signature; } kinds[] = {
+		{ PARAM_ONFI, "ONFI" }, { PARAM_JEDEC, "JEDEC" } };
+	unsigned char sig[5];
+	unsigned i;
+	int copy, len, size;
+
+	for (i = 0; i < 2; i++) {
+		len = strlen(kinds[i].signature);
+		send_command(0x90);
+		set_data_direction_out();
+		GPIO_SET_1(ADDRESS_LATCH_ENABLE);
+		send_address_byte(kinds[i].address);
+		GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+		spin(waits.whr);
+		read_bytes(sig, len);
+		if (memcmp(sig, kinds[i].signature, len) != 0)
 			continue;
 
-		if (memcmp(buf, buf + PAGE_SIZE, PAGE_SIZE) != 0) {
-			if (retry_count == 0) printf("\n");
-			if (retry_count < 5) {
-				printf("Page failed to read correctly! retrying\n");
-				retry_count++;
-				page = page & ~1;
-				goto retry_all;
-			}
-			printf("Too many retries. Perhaps bad block?\n");
-			fprintf(badlog, "Page %d seems to be bad\n", page_no);
-		}
-		if (write_spare) {
-			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
-				perror("fwrite");
-				return -1;
-			}
-		}
-		else {
-			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
-				perror("fwrite");
-				return -1;
+		send_command(0xEC);
+		set_data_direction_out();
+		GPIO_SET_1(ADDRESS_LATCH_ENABLE);
+		send_address_byte(kinds[i].address == PARAM_ONFI ? 0x00 : 0x40);
+		GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+		wait_ready(WAIT_OTHER | WAIT_DATA);
+		size = param_page_size(kinds[i].address);
+		for (copy = 0; copy < PARAM_PAGE_COPIES; copy++) {
+			read_bytes(p, size);
+			if (memcmp(p, kinds[i].address == PARAM_ONFI ? "ONFI" : "JESD", 4) == 0 &&
+			    param_page_crc(p, size) == le16(p + size - 2)) {
+				if (copy > 0)
+					printf("Parameter page copy %d was bad, using copy %d\n", copy, copy + 1);
+				return kinds[i].address;
 			}
 		}
-		retry_count = 0;
+		printf("%s parameter page: no copy with a good CRC\n", kinds[i].signature);
+		return 0;
 	}
-	fcloseall();
-	clock_t end = clock();
-	printf("\n\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	return 0;
+}
 
-	//show cursor
-	// printf("\e[?25h");
-	// fflush(stdout) ;
+// geometry and fastest timing mode from a parameter page, -1 when there is none
+int param_page_geometry(void)
+{
+	unsigned char p[PARAM_PAGE_SIZE];
+	char maker[13], model[21];
+	int kind, modes, mode;
+
+	if ((kind = read_param_page(p)) == 0)
+		return -1;
+	memcpy(maker, p + 32, 12);
+	maker[12] = 0;
+	memcpy(model, p + 44, 20);
+	model[20] = 0;
+	printf("%s parameter page: %s %s\n", kind == PARAM_ONFI ? "ONFI" : "JEDEC", maker, model);
+	// same offsets in both: data, spare, pages per block, blocks per LUN, LUNs
+	if (!geometry_set && set_geometry(le32(p + 80), le16(p + 84), le32(p + 92)) < 0)
+		printf("Parameter page geometry is out of what this tool handles, ignoring it\n");
+	geo.blocks = le32(p + 96) * p[100];
+	geo.luns = p[100];
+	// async timing modes (ONFI), async SDR speed grades (JEDEC), bit n: mode n
+	modes = le16(p + (kind == PARAM_ONFI ? 129 : 144)) & 0x3f;
+	for (mode = 5; mode > 0 && !(modes & (1 << mode)); mode--)
+		;
+	return kind == PARAM_ONFI ? mode : mode | 0x100;
 }
 
+// SET FEATURES timing mode (ONFI), before the waits change to it
+void set_timing_mode_feature(int mode)
+{
+	unsigned char p[4] = { (unsigned char)mode, 0, 0, 0 };
 
-/*int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+	send_command(0xEF);
+	set_data_direction_out();
+	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
+	send_address_byte(0x01);
+	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+	spin(waits.adl);
+	write_bytes(p, 4);
+	wait_ready(WAIT_OTHER);
+}
+
+/* before any command: geometry from a parameter page, else the ID (unless -g gave one), and the
+   timing mode, the fastest one the parameter page lists unless -m says. -1 for a small page chip */
+int init_geometry(void)
 {
-	int page, block_no, page_nbr, percent, i;
-	unsigned char buf[PAGE_SIZE], id[5], id2[5];;
-	FILE *f = fopen(outfile, "w+");
-	if (f == NULL) {
-		perror("fopen output file");
+	unsigned char id[5];
+	int param = param_page_geometry(), mode;
+	struct chip_entry *chip;
+
+	read_id_bytes(id);
+	chip = find_chip(id);
+	if (chip != NULL && (chip->quirks & CHIP_SMALL_PAGE)) {
+		printf("Chip database: %s %s is a small page chip, not supported\n", chip->maker, chip->device);
 		return -1;
 	}
-	if (GPIO_READ(N_READ_BUSY) == 0) {
-		error_msg((char*)"N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+	if (param < 0 && !geometry_set && decode_geometry(id) < 0 && !small_page)
+		printf("Page geometry from the ID makes no sense, assuming the default\n");
+	if (small_page)
 		return -1;
+	if (chip != NULL) {
+		printf("Chip database: %s %s\n", chip->maker, chip->device);
+		if (chip->features & CHIP_CACHE_READ)
+			cache_read = 1;
+		if (chip->features & CHIP_CACHE_PROGRAM)
+			cache_program = 1;
+		if (chip->features & CHIP_MULTI_PLANE)
+			multi_plane = 1;
 	}
+	printf("Page geometry: %d + %d bytes per page, %d pages per block", SPARE_COLUMN,
+		PAGE_SIZE - SPARE_COLUMN, PAGES_PER_BLOCK);
+	if (geo.blocks)
+		printf(", %d blocks in %d LUN(s)", geo.blocks, geo.luns);
+	printf("\n");
 
-	if (read_id(id) < 0)
-		return -1;
-	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
+	mode = timing_mode >= 0 ? timing_mode : param >= 0 ? param & 0xff : chip != NULL ? chip->timing_mode : 0;
+	// ONFI chips start in mode 0 and have to be told, JEDEC ones run any speed grade they list
+	if (mode > 0 && param >= 0 && param < 0x100)
+		set_timing_mode_feature(mode);
+	set_timing(&onfi_timing_mode[mode], timing_scale);
+	printf("Timing mode %d at %d%%: tWP %d, tWH %d, tRP %d, tREH %d, tREA %d, tWB %d, tWHR %d, tADL %d ns\n\n",
+		mode, timing_scale, timing.tWP * timing_scale / 100, timing.tWH * timing_scale / 100,
+		timing.tRP * timing_scale / 100, timing.tREH * timing_scale / 100, timing.tREA * timing_scale / 100,
+		timing.tWB * timing_scale / 100, timing.tWHR * timing_scale / 100, timing.tADL * timing_scale / 100);
+	return 0;
+}
 
-	printf("\nStart reading...\n\n");
-	clock_t start = clock();
+int send_read_command(int page)
+{
+	send_command(0x00);
 
+	// for (i = 0; i < 5; i++) {
+	// 	if (i < 2) {
+	// 		printf("Col Add%d = %d\n", i + 1, page_to_address(page, i));
+	// 	}
+	// 	else {
+	// 		printf("Row Add%d = %d\n", i - 1, page_to_address(page, i));
+	// 	}
+	// }
 
-	for (page = first_page_number; page < first_page_number + number_of_pages; page++) {
+	send_column_address(page, read_column);
+	send_command(0x30);
 
-		// printf("page = %d, n = %d\n",page, n);
+	return 0;
+}
 
-		// page_nbr = page - first_page_number + 1;
-		// percent = (100 * page_nbr) / number_of_pages;
-		// block_no = page / 64;
-		// printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\n", page, block_no, page_nbr, number_of_pages, percent);
-		printf("\nReading page n° %d\n", page);
+int send_write_command(int page, unsigned char *data)
+{
+	send_command(0x80);
+	send_address(page, 0, 5);
+	spin(waits.adl);
+	write_bytes(data, PAGE_SIZE);
+
+	return 0;
+}
+
+int send_eraseblock_command(int block)
+{
+	send_command(0x60);
+
+	// for (i = 2; i < 5; i++)
+	// 	printf("Row Add%d = %d\n", i - 1, page_to_address(block, i));
+
+	send_address(block, 2, 5);
+	send_command(0xD0);
+
+	return 0;
+}
+
+int read_status_byte()
+{
+	unsigned char data;
+
+	send_command(0x70);
+	spin(waits.whr);
+	read_bytes(&data, 1);
+
+	// printf("Status data = %d\n", data);
 
+	return data;
+}
+
+int read_status()
+{
+	return read_status_byte() & 1; // I/O0=0 success , I/O0=1 error
+}
+
+// random data output: clock the page register out again from column, no new array read
+void send_change_read_column(int column)
+{
+	send_command(0x05);
+	set_data_direction_out();
+	GPIO_SET_1(ADDRESS_LATCH_ENABLE);
+	send_address_byte(column);
+	send_address_byte(column >> 8);
+	GPIO_SET_0(ADDRESS_LATCH_ENABLE);
+	send_command(0xE0);
+	spin(waits.whr);
+}
+
+
+void read_page(int page, unsigned char *buf)
+{
+	send_read_command(page);
+	wait_ready(WAIT_READ);
+	read_bytes(buf, read_length);
+}
+
+// read the page twice to ensure correct operation, 0 when both reads agree. buf holds PAGE_SIZE * 2
+int read_page_twice(int page, unsigned char *buf)
+{
+	read_page(page, buf);
+	read_page(page, buf + PAGE_SIZE);
+	return memcmp(buf, buf + PAGE_SIZE, read_length) != 0 ? -1 : 0;
+}
+
+/* cache read (-c): 00h-30h loads the first page of a sequence, then 31h moves it to the cache
+   register and starts loading the next page into the data register while the cache register is
+   clocked out. 3Fh moves the last page over without starting another. tR is paid once per
+   sequence and hidden behind the transfers after that. a sequence never crosses a block */
+int cache_read_next = -1;	// page the running sequence loads next, -1: none running
+
+// wait until the array is done (status ARDY) so that any command can follow
+void cache_read_stop(void)
+{
+	if (cache_read_next < 0)
+		return;
+	wait_array_ready(WAIT_READ);
+	cache_read_next = -1;
+}
+
+// read page from a sequence ending at last_page, starting a new one unless page comes next
+void read_page_cached(int page, int last_page, unsigned char *buf)
+{
+	if (cache_read_next != page) {
+		cache_read_stop();
 		send_read_command(page);
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
-		}
-		set_data_direction_in();
-		for (i = 0; i < PAGE_SIZE; i++) {
-			GPIO_SET_0(N_READ_ENABLE);
-			shortpause();
-			buf[i] = GPIO_DATA8_IN(); //
-			shortpause();
-			GPIO_SET_1(N_READ_ENABLE);
-			shortpause();
-		}
-		if (write_spare) {
-			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
-				perror("fwrite");
-				return -1;
-			}
+		wait_ready(WAIT_READ);
+	}
+	if (page < last_page) {
+		send_command(0x31);
+		cache_read_next = page + 1;
+	}
+	else {
+		send_command(0x3F);
+		cache_read_next = -1;
+	}
+	wait_ready(WAIT_CACHE | WAIT_DATA);
+	if (read_column != 0) // the cache register comes out from column 0
+		send_change_read_column(read_column);
+	read_bytes(buf, read_length);
+}
+
+/* read the first two neighbouring pages of the block starting at block_page that differ, plainly
+   and as a cache read sequence. 0 when the chip does cache reads right, -1 when not, 1 when the
+   block has no such pair: a chip ignoring 31h/3Fh hands out page N twice, which two equal pages
+   (an erased block) can't tell from a working one */
+int probe_cache_read(int block_page)
+{
+	unsigned char plain[MAX_PAGE_SIZE * 2], next[MAX_PAGE_SIZE * 2], cached[MAX_PAGE_SIZE * 2];
+	int page;
+
+	if (read_page_twice(block_page, plain) != 0)
+		return -1;
+	for (page = block_page; page + 1 < block_page + PAGES_PER_BLOCK; page++) {
+		if (read_page_twice(page + 1, next) != 0)
+			return -1;
+		if (memcmp(plain, next, read_length) != 0)
+			break;
+	}
+	if (page + 1 == block_page + PAGES_PER_BLOCK)
+		return 1;
+	memcpy(plain + PAGE_SIZE, next, PAGE_SIZE);
+	read_page_cached(page, page + 1, cached);
+	read_page_cached(page + 1, page + 1, cached + PAGE_SIZE);
+	return memcmp(plain, cached, read_length) != 0 ||
+	       memcmp(plain + PAGE_SIZE, cached + PAGE_SIZE, read_length) != 0 ? -1 : 0;
+}
+
+/* cache program (-c): 15h instead of 10h hands the page over to the cache register and the chip is
+   ready for the next one as soon as the register is free, while the previous page programs. 10h
+   closes the sequence (last page of the block or the run). status FAILC (bit 1) then tells about
+   the page programmed before, FAIL (bit 0) about the one just done. chips that ignore 15h are
+   caught by the array still being idle right after it, and get a plain 10h */
+int cache_prog_page = -1;	// page programming in the background after 15h, -1: none
+int cache_prog_failures = 0;
+int cache_program_works = 1;
+
+void cache_program_failed(int page)
+{
+	printf("\nFailed to write page %d correctly (cache program)! Perhaps bad block?\n", page);
+	cache_prog_failures++;
+	adapt_timing(0);
+}
+
+// wait until the page programming in the background is done, so that any command can follow
+void cache_program_stop(void)
+{
+	int status;
+
+	if (cache_prog_page < 0)
+		return;
+	status = wait_array_ready(WAIT_PROG);
+	if (status > 0 && (status & 1))
+		cache_program_failed(cache_prog_page);
+	cache_prog_page = -1;
+}
+
+// program page, within a cache program sequence ending at seq_last with -c.
+// 0 when good, 1 when this page failed (failures of earlier pages are reported on the way)
+int program_page(int page, int seq_last, unsigned char *data)
+{
+	int status;
+
+	send_write_command(page, data);
+	if (cache_program && cache_program_works && page < seq_last) {
+		send_command(0x15);
+		wait_ready(WAIT_CACHE);
+		status = read_status_byte();
+		if (cache_prog_page < 0 && (status & 0x20)) {
+			printf("\nCache program (15h) not supported, programming page by page\n");
+			cache_program_works = 0;
 		}
 		else {
-			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
-				perror("fwrite");
-				return -1;
-			}
+			if (cache_prog_page >= 0 && (status & 2))
+				cache_program_failed(cache_prog_page);
+			cache_prog_page = page;
+			return 0;
 		}
 	}
-	fcloseall();
-	clock_t end = clock();
-	printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	send_command(0x10);
+	wait_ready(WAIT_PROG);
+	status = read_status_byte();
+	if (cache_prog_page >= 0 && (status & 2))
+		cache_program_failed(cache_prog_page);
+	cache_prog_page = -1;
+	return status & 1; // I/O0=0 success , I/O0=1 error
 }
-*/
-int write_pages(int first_page_number, int number_of_pages, char *infile)
+
+/* multi-plane operations (-p): a block pair (even block, odd block: the plane is the lowest block
+   address bit) is read, programmed and erased two pages/blocks at a time, sharing one tR, tPROG
+   or tBERS. Samsung and Hynix chips want 60h-60h-30h, 80h..11h-81h..10h and 60h-60h-D0h, ONFI
+   ones 00h..32h-00h..30h, 80h..11h-80h..10h and 60h-D1h-60h-D0h */
+int planes_onfi = 0;
+
+// whether the chip can do it, and which command set it takes
+int setup_multi_plane(unsigned char id[5])
 {
-	int page, block_no, page_nbr, percent, retry_count;
-	unsigned char buf[PAGE_SIZE], id[5], id2[5];;
+	int planes = 1 << ((id[4] >> 2) & 3); // as print_id decodes it
 
-	if (read_id(id) < 0)
-		return -1;
-	print_id(id);
-	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
-	sleep(3);
+	if (planes < 2) {
+		printf("Chip reports a single plane, multi-plane operations off\n");
+		return 0;
+	}
+	planes_onfi = id[0] != 0xEC && id[0] != 0xAD;
+	printf("Multi-plane operations on two of %d planes (%s commands)\n", planes, planes_onfi ? "ONFI" : "Samsung/Hynix");
+	return 1;
+}
 
-	printf("\nStart writing...\n");
-	clock_t start = clock();
+// whether block and block + 1 make a plane pair, both inside the run [first, end)
+inline int plane_pair(int block, int first_block, int end_block)
+{
+	return multi_plane && (block & 1) == 0 && block >= first_block && block + 2 <= end_block &&
+	       !block_is_bad(block) && !block_is_bad(block + 1);
+}
 
+// clock both pages out of their page registers after read_page_pair
+void read_page_pair_output(int page0, int page1, unsigned char *buf0, unsigned char *buf1)
+{
+	if (planes_onfi) {
+		send_command(0x06);
+		send_column_address(page0, read_column);
+		send_command(0xE0);
+		spin(waits.whr);
+		read_bytes(buf0, read_length);
+		send_command(0x06);
+		send_column_address(page1, read_column);
+		send_command(0xE0);
+		spin(waits.whr);
+		read_bytes(buf1, read_length);
+	}
+	else {
+		send_command(0x00);
+		send_address(page0, 0, 5);
+		send_change_read_column(read_column);
+		read_bytes(buf0, read_length);
+		send_command(0x00);
+		send_address(page1, 0, 5);
+		send_change_read_column(read_column);
+		read_bytes(buf1, read_length);
+	}
+}
 
-	FILE *f = fopen(infile, "rb");
-	if (f == NULL) {
-		perror("fopen input file");
-		return -1;
+// read page0 (even block) and page1 (odd block) with a single tR
+void read_page_pair(int page0, int page1, unsigned char *buf0, unsigned char *buf1)
+{
+	cache_read_stop();
+	if (planes_onfi) {
+		send_command(0x00);
+		send_address(page0, 0, 5);
+		send_command(0x32);
+		wait_ready(WAIT_CACHE | WAIT_DATA);
+		send_command(0x00);
+		send_address(page1, 0, 5);
+		send_command(0x30);
 	}
+	else {
+		send_command(0x60);
+		send_address(page0, 2, 5);
+		send_command(0x60);
+		send_address(page1, 2, 5);
+		send_command(0x30);
+	}
+	wait_ready(WAIT_READ);
+	read_page_pair_output(page0, page1, buf0, buf1);
+}
 
-	// printf("first_page_number = %d\n", first_page_number);
-	// printf("number of pages = %d\n", number_of_pages);
+// program both pages with a single tPROG, read_status() style result
+int program_page_pair(int page0, int page1, unsigned char *data0, unsigned char *data1)
+{
+	cache_program_stop();
+	send_write_command(page0, data0);
+	send_command(0x11);
+	wait_ready(WAIT_CACHE);
+	send_command(planes_onfi ? 0x80 : 0x81);
+	send_address(page1, 0, 5);
+	spin(waits.adl);
+	write_bytes(data1, PAGE_SIZE);
+	send_command(0x10);
+	wait_ready(WAIT_PROG);
+	return read_status();
+}
 
+// erase block and block + 1 with a single tBERS, read_status() style result
+int erase_block_pair(int block)
+{
+	send_command(0x60);
+	send_address(block * PAGES_PER_BLOCK, 2, 5);
+	if (planes_onfi) {
+		send_command(0xD1);
+		wait_ready(WAIT_CACHE);
+	}
+	send_command(0x60);
+	send_address((block + 1) * PAGES_PER_BLOCK, 2, 5);
+	send_command(0xD0);
+	wait_ready(WAIT_ERASE);
+	return read_status();
+}
 
-	for (retry_count = 0, page = first_page_number; page < first_page_number + number_of_pages; page++) {
+// read the ID until it matches again (see id_check_every)
+void check_id(unsigned char id[5])
+{
+	unsigned char id2[5];
+	struct timespec t0, t1;
+
+	if (bus_timed_out) // the command is stopping anyway, and a busy chip gives no ID
+		return;
+	bus_time(&t0);
+	cache_read_stop();
+	cache_program_stop();
+	for (;;) {
+		read_id_bytes(id2);
+		if (memcmp(id, id2, 5) == 0)
+			break;
+		printf("\nNAND ID has changed! retrying");
+	}
+	bus_time(&t1);
+	id_check_ns += elapsed_ns(&t0, &t1);
+	id_checks++;
+	id_pages_since_check = 0;
+}
 
-	  retry_all:
+// before each operation covering pages pages, error: the previous attempt failed
+void id_checkpoint(unsigned char id[5], int pages, int error)
+{
+	if (error || (id_check_every > 0 && id_pages_since_check >= id_check_every))
+		check_id(id);
+	id_pages_since_check += pages;
+}
 
-		if (retry_count == 0) {
-			// page_no = page / 2;
-			page_nbr = page - first_page_number + 1;
-			percent = (100 * page_nbr) / number_of_pages;
-			block_no = page / 64;
-			printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, block_no, page_nbr, number_of_pages, percent);
-			fflush(stdout);
+
+/* ECC for -v ecc */
+#define ECC_STEP	512
+#define ECC_BYTES	3
+#define ECC_STEPS	(SPARE_COLUMN / ECC_STEP)
+#define ECC_OFFSET	(PAGE_SIZE - ECC_STEPS * ECC_BYTES)
+
+unsigned char byte_parity[256];	// 1 when the byte has an odd number of bits set
+int ecc_corrected = 0, ecc_uncorrectable = 0;
+
+void init_ecc(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		byte_parity[i] = (i ^ (i >> 1) ^ (i >> 2) ^ (i >> 3) ^ (i >> 4) ^ (i >> 5) ^ (i >> 6) ^ (i >> 7)) & 1;
+}
+
+// even line parities in the even bits, odd ones in the odd bits
+inline unsigned char ecc_interleave(unsigned int even, unsigned int odd)
+{
+	int k;
+	unsigned char b = 0;
+
+	for (k = 0; k < 4; k++)
+		b |= ((even >> k) & 1) << (2 * k) | ((odd >> k) & 1) << (2 * k + 1);
+	return b;
+}
+
+/* the line parities only depend on which bytes have odd parity: LP(2k+1) is bit k of the XOR of
+   their offsets, LP(2k) that plus the overall parity. column parities come from the XOR of all bytes */
+void ecc_calculate(const unsigned char *data, unsigned char ecc[ECC_BYTES])
+{
+	unsigned int i, c = 0, odd = 0, even;
+
+	for (i = 0; i < ECC_STEP; i++) {
+		c ^= data[i];
+		odd ^= i & -(unsigned int)byte_parity[data[i]];
+	}
+	even = byte_parity[c] ? ~odd : odd;
+
+	ecc[0] = ~ecc_interleave(even, odd);
+	ecc[1] = ~ecc_interleave(even >> 4, odd >> 4);
+	ecc[2] = ~(byte_parity[c & 0xf0] << 7 | byte_parity[c & 0x0f] << 6 |
+		   byte_parity[c & 0xcc] << 5 | byte_parity[c & 0x33] << 4 |
+		   byte_parity[c & 0xaa] << 3 | byte_parity[c & 0x55] << 2 |
+		   ((odd >> 8) & 1) << 1 | ((even >> 8) & 1));
+}
+
+/* 0: clean, 1: single bit error at byte, bit, 2: single bit error in the ECC bytes themselves,
+   -1: uncorrectable */
+int ecc_check(const unsigned char stored[ECC_BYTES], const unsigned char calc[ECC_BYTES], int *byte, int *bit)
+{
+	unsigned int s0 = stored[0] ^ calc[0], s1 = stored[1] ^ calc[1], s2 = stored[2] ^ calc[2];
+
+	if ((s0 | s1 | s2) == 0)
+		return 0;
+	// single data bit: exactly one parity of each pair disagrees, the odd ones spell the address
+	if (((s0 ^ (s0 >> 1)) & 0x55) == 0x55 && ((s1 ^ (s1 >> 1)) & 0x55) == 0x55 &&
+	    ((s2 ^ (s2 >> 1)) & 0x55) == 0x55) {
+		*byte = (s0 >> 1 & 1) | (s0 >> 2 & 2) | (s0 >> 3 & 4) | (s0 >> 4 & 8) |
+			(s1 << 3 & 0x10) | (s1 << 2 & 0x20) | (s1 << 1 & 0x40) | (s1 & 0x80) | (s2 << 7 & 0x100);
+		*bit = (s2 >> 3 & 1) | (s2 >> 4 & 2) | (s2 >> 5 & 4);
+		return 1;
+	}
+	if (__builtin_popcount(s0) + __builtin_popcount(s1) + __builtin_popcount(s2) == 1)
+		return 2;
+	return -1;
+}
+
+// check every sector of a page against its ECC, 0 unless a sector is uncorrectable.
+// single bit errors are counted and logged, the data is kept as read
+int check_page_ecc(int page, unsigned char *buf, FILE *badlog)
+{
+	int step, byte, bit, result = 0;
+	unsigned char calc[ECC_BYTES];
+
+	for (step = 0; step < ECC_STEPS; step++) {
+		ecc_calculate(buf + step * ECC_STEP, calc);
+		switch (ecc_check(buf + ECC_OFFSET + step * ECC_BYTES, calc, &byte, &bit)) {
+		case 1:
+			ecc_corrected++;
+			fprintf(badlog, "Page %d: single bit error at byte %d bit %d\n", page, step * ECC_STEP + byte, bit);
+			break;
+		case 2:
+			ecc_corrected++;
+			fprintf(badlog, "Page %d: single bit error in ECC of sector %d\n", page, step);
+			break;
+		case -1:
+			result = -1;
+			break;
 		}
+	}
+	return result;
+}
 
-		fseek(f, page * PAGE_SIZE, SEEK_SET);
-		fread(buf, PAGE_SIZE, 1, f);
+/* when the two copies of a page differ, only the 512 byte sectors (by column, the spare area is
+   the last one) where they do are clocked out again from the page register, twice, until both
+   fetches agree. a flaky clip then costs a few hundred bytes per retry instead of the page */
+#define REREAD_SECTOR	512
+#define REREAD_TRIES	3
+int sectors_reread = 0;
 
-		// printf("\nwriting page n°%d\n", page);
+// 0 when every differing sector of buf and buf + PAGE_SIZE read stable again
+int reread_sectors(unsigned char *buf)
+{
+	unsigned char again[REREAD_SECTOR];
+	int off, n, tries;
 
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
+	for (off = 0; off < read_length; off += n) {
+		n = MIN(REREAD_SECTOR - (read_column + off) % REREAD_SECTOR, read_length - off);
+		if (memcmp(buf + off, buf + PAGE_SIZE + off, n) == 0)
+			continue;
+		for (tries = 0; ; tries++) {
+			if (tries == REREAD_TRIES)
+				return -1;
+			send_change_read_column(read_column + off);
+			read_bytes(buf + off, n);
+			send_change_read_column(read_column + off);
+			read_bytes(again, n);
+			if (memcmp(buf + off, again, n) == 0)
+				break;
 		}
+		memcpy(buf + PAGE_SIZE + off, again, n);
+		sectors_reread++;
+	}
+	return 0;
+}
 
-		send_write_command(page, buf);
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
+/* read page into buf (PAGE_SIZE * 2) and verify it as -v says, 0 when good. the first attempt at a
+   page comes from a cache read sequence ending at seq_last when -c is on, its second copy for -v
+   double then from the cache register again, as it always does for -v register. retries always
+   read the page on its own */
+int read_page_verified(int page, int seq_last, int retry, unsigned char *buf, FILE *badlog)
+{
+	int cached = cache_read && !retry;
+
+	if (cached)
+		read_page_cached(page, seq_last, buf);
+	else {
+		cache_read_stop();
+		read_page(page, buf);
+	}
+	if (verify_mode == VERIFY_ECC)
+		return check_page_ecc(page, buf, badlog);
+	if (cached || verify_mode == VERIFY_REGISTER) {
+		send_change_read_column(read_column);
+		read_bytes(buf + PAGE_SIZE, read_length);
+	}
+	else
+		read_page(page, buf + PAGE_SIZE);
+	if (memcmp(buf, buf + PAGE_SIZE, read_length) == 0)
+		return 0;
+	return reread_sectors(buf);
+}
+
+/* pages go from the bus loop to the output file through a single producer, single consumer
+   ring, and a writer thread does the write()s. a slow SD card flush then stalls the writer, not
+   the bus timing; the bus loop only waits when the ring is full */
+#define RING_SLOTS	512	// pages, 8 blocks
+#define RING_BATCH	64	// pages per write()
+
+struct {
+	unsigned char *buf;
+	int page_bytes;
+	int fd;
+	unsigned head;		// next slot the bus loop fills, only it stores
+	unsigned tail;		// next slot the writer writes out, only it stores
+	int done, error;
+	pthread_t thread;
+	unsigned high_water;	// most pages ever waiting in the ring
+	int stalls;		// times the bus loop found it full
+	double stall_ns;
+} ring;
+
+void *ring_writer(void *arg)
+{
+	unsigned head, tail = ring.tail, n;
+	size_t len;
+	ssize_t ret;
+	unsigned char *p;
+
+	(void)arg;
+	for (;;) {
+		head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (__atomic_load_n(&ring.done, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail)
+				break;
+			usleep(1000);
+			continue;
 		}
-		// read_status();
-		if (read_status()) {
-			if (retry_count == 0) printf("\n");
-			if (retry_count < 5) {
-				printf("Failed to write page correctly! retrying\n");
-				retry_count++;
-				goto retry_all;
+		// up to the end of the buffer, so a batch is one contiguous write
+		n = MIN(MIN(head - tail, (unsigned)RING_BATCH), RING_SLOTS - tail % RING_SLOTS);
+		p = ring.buf + (size_t)(tail % RING_SLOTS) * ring.page_bytes;
+		for (len = (size_t)n * ring.page_bytes; len > 0; p += ret, len -= ret) {
+			ret = write(ring.fd, p, len);
+			if (ret < 0) {
+				perror("write output file");
+				__atomic_store_n(&ring.error, 1, __ATOMIC_RELEASE);
+				return NULL;
 			}
-			printf("Too many retries. Perhaps bad block?\n");
-			// retry_count = 0;
 		}
-		retry_count = 0;
+		tail += n;
+		__atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
 	}
+	return NULL;
+}
 
+int ring_open(char *outfile, int number_of_pages, int page_bytes)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
 
+	memset(&ring, 0, sizeof(ring));
+	ring.page_bytes = page_bytes;
+	if (direct_io) {
+		if (ring.page_bytes % 512 == 0)
+			flags |= O_DIRECT;
+		else
+			printf("%d byte pages can't go through O_DIRECT, writing through the page cache\n", ring.page_bytes);
+	}
+	if ((ring.fd = open(outfile, flags, 0644)) < 0) {
+		perror("open output file");
+		return -1;
+	}
+	// best effort, keeps the file from fragmenting as it grows
+	if (fallocate(ring.fd, 0, 0, (off_t)number_of_pages * ring.page_bytes) < 0)
+		perror("fallocate output file");
+	if (posix_memalign((void **)&ring.buf, 4096, (size_t)RING_SLOTS * ring.page_bytes) != 0) {
+		printf("out of memory for the writer ring\n");
+		close(ring.fd);
+		return -1;
+	}
+	if (pthread_create(&ring.thread, NULL, ring_writer, NULL) != 0) {
+		printf("can't start the writer thread\n");
+		free(ring.buf);
+		close(ring.fd);
+		return -1;
+	}
+	return 0;
+}
 
+// queue a page for the writer, waits only when the ring is full
+int write_page_out(unsigned char *buf)
+{
+	unsigned used, head = ring.head;
+	struct timespec t0, t1;
+
+	used = head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	if (used == RING_SLOTS) {
+		ring.stalls++;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == RING_SLOTS &&
+		       !__atomic_load_n(&ring.error, __ATOMIC_ACQUIRE))
+			usleep(100);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ring.stall_ns += elapsed_ns(&t0, &t1);
+		used = head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	}
+	if (__atomic_load_n(&ring.error, __ATOMIC_ACQUIRE) || bus_timed_out) // no page read after a timeout
+		return -1;
+	memcpy(ring.buf + (size_t)(head % RING_SLOTS) * ring.page_bytes, buf, ring.page_bytes);
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+	if (used + 1 > ring.high_water)
+		ring.high_water = used + 1;
+	return 0;
+}
 
+// let the writer drain the ring, 0 when everything reached the file
+int ring_close(void)
+{
+	__atomic_store_n(&ring.done, 1, __ATOMIC_RELEASE);
+	pthread_join(ring.thread, NULL);
+	free(ring.buf);
+	// a run cut short leaves no fallocate()d zeros after the pages it read
+	if (ftruncate(ring.fd, (off_t)ring.tail * ring.page_bytes) < 0)
+		perror("truncate output file");
+	if (close(ring.fd) < 0) {
+		perror("close output file");
+		return -1;
+	}
+	return ring.error ? -1 : 0;
+}
 
-	fcloseall();
-	clock_t end = clock();
-	printf("\nWrite done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+// page read on its own after a failed attempt: the usual retries, then bad.log
+void read_page_retrying(unsigned char id[5], int page, unsigned char *buf, FILE *badlog)
+{
+	int retry_count;
+
+	for (retry_count = 1; ; retry_count++) {
+		id_checkpoint(id, 1, 1);
+		if (read_page_verified(page, page, retry_count, buf, badlog) == 0 || bus_timed_out)
+			return;
+		if (retry_count == 5) {
+			printf("\nToo many retries. Perhaps bad block?\n");
+			fprintf(badlog, "Page %d seems to be bad\n", page);
+			ecc_uncorrectable += verify_mode == VERIFY_ECC;
+			return;
+		}
+		printf("\nPage failed to read correctly! retrying\n");
+	}
 }
 
-int erase_blocks(int first_block_number, int number_of_blocks)
+// multi-plane read of both pages verified as -v says, buf0 holds PAGE_SIZE * 2.
+// bit 0 set when page0 failed, bit 1 when page1 did
+int read_page_pair_verified(int page0, int page1, unsigned char *buf0, unsigned char *buf1, FILE *badlog)
+{
+	unsigned char again[MAX_PAGE_SIZE];
+
+	read_page_pair(page0, page1, buf0, buf1);
+	if (verify_mode == VERIFY_ECC)
+		return (check_page_ecc(page0, buf0, badlog) != 0) | (check_page_ecc(page1, buf1, badlog) != 0) << 1;
+	if (verify_mode == VERIFY_REGISTER)
+		read_page_pair_output(page0, page1, buf0 + PAGE_SIZE, again);
+	else
+		read_page_pair(page0, page1, buf0 + PAGE_SIZE, again);
+	return (memcmp(buf0, buf0 + PAGE_SIZE, read_length) != 0) | (memcmp(buf1, again, read_length) != 0) << 1;
+}
+
+// bytes column..column + length - 1 of every page into outfile
+int read_pages(int first_page_number, int number_of_pages, char *outfile, int column, int length)
 {
-	int block, block_no, block_nbr, percent, i, n, retry_count;
-	unsigned char id[5], id2[5];
+	int page, block_no, page_nbr, percent, retry_count, i, failed;
+	unsigned char id[5];
+	unsigned char buf[MAX_PAGE_SIZE * 2];
+	unsigned char *pair_buf = NULL;
+	FILE *badlog;
+	int skip = 0;	// where the wanted bytes start in buf
+
+	if ((badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
+		return -1;
+	}
+	if (GPIO_READ(N_READ_BUSY) == 0) {
+		error_msg((char*)"N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+		return -1;
+	}
 
 	if (read_id(id) < 0)
 		return -1;
@@ -941,36 +2553,462 @@ int erase_blocks(int first_block_number, int number_of_blocks)
 	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
 	sleep(3);
 
-	printf("\nStart erasing...\n");
-	clock_t start = clock();
+	if (multi_plane && (multi_plane = setup_multi_plane(id)) != 0 &&
+	    (pair_buf = (unsigned char *)malloc(PAGES_PER_BLOCK * PAGE_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if (cache_read && number_of_pages > 1) {
+		switch (probe_cache_read(first_page_number & ~(PAGES_PER_BLOCK - 1))) {
+		case 0:
+			printf("Cache read (31h/3Fh) works, using it\n");
+			break;
+		case 1:
+			printf("Cache read (31h/3Fh) can't be checked, the first block has no two different pages: reading page by page\n");
+			cache_read = 0;
+			break;
+		default:
+			printf("Cache read (31h/3Fh) does not give the same data, reading page by page\n");
+			cache_read = 0;
+		}
+	}
 
-	for (retry_count = 0, block = first_block_number; block < (first_block_number + number_of_blocks); block++) {
+	if (verify_mode == VERIFY_ECC) { // needs the whole page, cut after the check
+		skip = column;
+		read_column = 0;
+		read_length = PAGE_SIZE;
+	}
+	else {
+		read_column = column;
+		read_length = length;
+	}
+	// only now, so that a failed check leaves no writer thread nor a truncated file behind
+	if (ring_open(outfile, number_of_pages, length) < 0)
+		return -1;
 
-	  retry_all:
-			
-		block_nbr = block - first_block_number + 1;
-		percent = (100 * block_nbr) / number_of_blocks;
+	printf("\nStart reading...\n");
+	clock_t start = clock();
+	struct timespec wall_start;
+	bus_time(&wall_start);
+
+
+	for (page = first_page_number; page < first_page_number + number_of_pages; page++) {
+		page_nbr = page - first_page_number + 1;
+		percent = (100 * page_nbr) / number_of_pages;
+		block_no = page / PAGES_PER_BLOCK;
+		printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\r", page, block_no, page_nbr, number_of_pages, percent);
+		fflush(stdout);
+
+		if (page % PAGES_PER_BLOCK == 0 && plane_pair(block_no, (first_page_number + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK,
+							(first_page_number + number_of_pages) / PAGES_PER_BLOCK)) {
+			// both blocks at once, the odd one is kept until the even one is written out
+			for (i = 0; i < PAGES_PER_BLOCK; i++) {
+				id_checkpoint(id, 2, 0);
+				failed = read_page_pair_verified(page + i, page + PAGES_PER_BLOCK + i, buf, pair_buf + i * PAGE_SIZE, badlog);
+				adapt_timing(failed == 0);
+				// only the page that failed is read again, on its own with its own retries
+				if (failed & 1)
+					read_page_retrying(id, page + i, buf, badlog);
+				if (write_page_out(buf + skip) < 0)
+					goto write_failed;
+				// buf is free again: a retry needs PAGE_SIZE * 2, more than the slot has
+				if (failed & 2) {
+					read_page_retrying(id, page + PAGES_PER_BLOCK + i, buf, badlog);
+					memcpy(pair_buf + i * PAGE_SIZE, buf, PAGE_SIZE);
+				}
+			}
+			for (i = 0; i < PAGES_PER_BLOCK; i++)
+				if (write_page_out(pair_buf + i * PAGE_SIZE + skip) < 0)
+					goto write_failed;
+			page += 2 * PAGES_PER_BLOCK - 1;
+			continue;
+		}
+
+		if (block_is_bad(block_no)) {
+			memset(buf, 0xff, PAGE_SIZE);
+			bbt_skipped += page % PAGES_PER_BLOCK == 0 || page == first_page_number;
+			if (write_page_out(buf + skip) < 0)
+				goto write_failed;
+			continue;
+		}
+
+		for (retry_count = 0; ; retry_count++) {
+			id_checkpoint(id, 1, retry_count > 0);
+			if (read_page_verified(page, MIN(first_page_number + number_of_pages - 1, page | (PAGES_PER_BLOCK - 1)),
+					       retry_count, buf, badlog) == 0) {
+				adapt_timing(1);
+				break;
+			}
+			if (bus_timed_out)
+				break;
+			adapt_timing(0);
+			if (retry_count == 0) printf("\n");
+			if (retry_count == 5) {
+				printf("Too many retries. Perhaps bad block?\n");
+				fprintf(badlog, "Page %d seems to be bad\n", page);
+				ecc_uncorrectable += verify_mode == VERIFY_ECC;
+				break;
+			}
+			printf("Page failed to read correctly! retrying\n");
+		}
+
+		if (write_page_out(buf + skip) < 0)
+			goto write_failed;
+	}
+	cache_read_stop();
+	free(pair_buf);
+	fcloseall();
+	if (ring_close() < 0)
+		return -1;
+	printf("\n\nReading done in %f seconds\n", (float)(clock() - start) / CLOCKS_PER_SEC);
+	print_run_report(number_of_pages, "pages", length, &wall_start);
+	printf("Writer ring:        %u of %d pages high water, %d stalls (%.3f s)\n", ring.high_water, RING_SLOTS,
+		ring.stalls, ring.stall_ns / 1e9);
+	if (bbt)
+		printf("Bad blocks:         %d skipped, read as 0xFF\n", bbt_skipped);
+	if (verify_mode != VERIFY_ECC)
+		printf("Sector re-reads:    %d sectors fetched again after a mismatch\n", sectors_reread);
+	if (verify_mode == VERIFY_ECC)
+		printf("ECC:                %d single bit errors, %d uncorrectable pages (see bad.log)\n",
+			ecc_corrected, ecc_uncorrectable);
+	return 0;
+
+write_failed:
+	cache_read_stop();
+	free(pair_buf);
+	ring_close();
+	return -1;
+
+	//show cursor
+	// printf("\e[?25h");
+	// fflush(stdout) ;
+}
+
+
+/*int read_pages(int first_page_number, int number_of_pages, char *outfile, int write_spare)
+{
+	int page, block_no, page_nbr, percent, i;
+	unsigned char buf[MAX_PAGE_SIZE], id[5], id2[5];;
+	FILE *f = fopen(outfile, "w+");
+	if (f == NULL) {
+		perror("fopen output file");
+		return -1;
+	}
+	if (GPIO_READ(N_READ_BUSY) == 0) {
+		error_msg((char*)"N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+		return -1;
+	}
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	printf("\nStart reading...\n\n");
+	clock_t start = clock();
+
+
+	for (page = first_page_number; page < first_page_number + number_of_pages; page++) {
+
+		// printf("page = %d, n = %d\n",page, n);
+
+		// page_nbr = page - first_page_number + 1;
+		// percent = (100 * page_nbr) / number_of_pages;
+		// block_no = page / PAGES_PER_BLOCK;
+		// printf("Reading page n° %d in block n° %d (page %d of %d), %d%%\n", page, block_no, page_nbr, number_of_pages, percent);
+		printf("\nReading page n° %d\n", page);
+
+		send_read_command(page);
+		wait_ready(WAIT_READ);
+		set_data_direction_in();
+		for (i = 0; i < PAGE_SIZE; i++) {
+			GPIO_SET_0(N_READ_ENABLE);
+			shortpause();
+			buf[i] = GPIO_DATA8_IN(); //
+			shortpause();
+			GPIO_SET_1(N_READ_ENABLE);
+			shortpause();
+		}
+		if (write_spare) {
+			if (fwrite(buf, PAGE_SIZE, 1, f) != 1) {
+				perror("fwrite");
+				return -1;
+			}
+		}
+		else {
+			if (fwrite(buf, 512 * (PAGE_SIZE / 512), 1, f) != 1) {
+				perror("fwrite");
+				return -1;
+			}
+		}
+	}
+	fcloseall();
+	clock_t end = clock();
+	printf("\nReading done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+}
+*/
+int blank_skipped = 0;
+
+// 1 when page (data and spare) is all 0xFF, what an erased page already holds
+int page_is_blank(unsigned char *page)
+{
+	const unsigned long long *w = (const unsigned long long *)page;
+	unsigned long long acc = ~0ULL;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / 8; i++) // 64 bit words, PAGE_SIZE and page offsets are multiples of 8
+		acc &= w[i];
+	return acc == ~0ULL;
+}
+
+// program page i of block and block + 1 together for the whole pair, page by page on failure
+void write_block_pair(unsigned char *image, unsigned char id[5], int block)
+{
+	int i, p, retry_count, blank[2];
+	unsigned char *buf[2];
+
+	for (i = 0; i < PAGES_PER_BLOCK; i++) {
+		for (p = 0; p < 2; p++) {
+			buf[p] = image + (size_t)((block + p) * PAGES_PER_BLOCK + i) * PAGE_SIZE;
+			blank[p] = skip_blank && page_is_blank(buf[p]);
+			blank_skipped += blank[p];
+		}
+		if (!blank[0] && !blank[1]) {
+			id_checkpoint(id, 2, 0);
+			if (program_page_pair(block * PAGES_PER_BLOCK + i, (block + 1) * PAGES_PER_BLOCK + i, buf[0], buf[1]) == 0) {
+				adapt_timing(1);
+				continue;
+			}
+			adapt_timing(0);
+			printf("\nFailed to write pages %d and %d together! writing them one by one\n", block * PAGES_PER_BLOCK + i, (block + 1) * PAGES_PER_BLOCK + i);
+		}
+		for (p = 0; p < 2; p++)
+			for (retry_count = 1; !blank[p]; retry_count++) {
+				id_checkpoint(id, 1, 1);
+				if (program_page((block + p) * PAGES_PER_BLOCK + i, (block + p) * PAGES_PER_BLOCK + i, buf[p]) == 0)
+					break;
+				if (retry_count == 5) {
+					printf("Too many retries. Perhaps bad block?\n");
+					break;
+				}
+				printf("Failed to write page correctly! retrying\n");
+			}
+	}
+}
+
+/* the input image is mapped rather than read: pages go to send_write_command straight from
+   the page cache, and the kernel reads the next block ahead while this one programs */
+unsigned char *map_image(char *infile, int end_page, size_t *size)
+{
+	struct stat st;
+	unsigned char *image;
+	int fd = open(infile, O_RDONLY);
+
+	if (fd < 0) {
+		perror("open input file");
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat input file");
+		close(fd);
+		return NULL;
+	}
+	*size = (size_t)end_page * PAGE_SIZE;
+	if ((size_t)st.st_size < *size) {
+		printf("Input file is too short: %lld bytes, pages up to %d need %zu\n", (long long)st.st_size, end_page - 1, *size);
+		close(fd);
+		return NULL;
+	}
+	image = (unsigned char *)mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		perror("mmap input file");
+		return NULL;
+	}
+	madvise(image, *size, MADV_SEQUENTIAL);
+	return image;
+}
+
+// start reading the block after the one that begins at page
+inline void prefetch_block(unsigned char *image, size_t size, int page)
+{
+	size_t from = (size_t)(page + PAGES_PER_BLOCK) * PAGE_SIZE;
+	size_t page_size = getpagesize();
+
+	from &= ~(page_size - 1); // madvise wants an aligned start
+	if (from < size)
+		madvise(image + from, MIN(size - from, (size_t)BLOCK_SIZE * 2), MADV_WILLNEED);
+}
+
+int write_pages(int first_page_number, int number_of_pages, char *infile)
+{
+	int page, block_no, page_nbr, percent, retry_count;
+	unsigned char id[5], *buf, *image;
+	size_t image_size;
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	if (multi_plane)
+		multi_plane = setup_multi_plane(id);
+
+	printf("\nStart writing...\n");
+	clock_t start = clock();
+	struct timespec wall_start;
+	bus_time(&wall_start);
+
+
+	image = map_image(infile, first_page_number + number_of_pages, &image_size);
+	if (image == NULL)
+		return -1;
+	prefetch_block(image, image_size, first_page_number - PAGES_PER_BLOCK);
+
+	// printf("first_page_number = %d\n", first_page_number);
+	// printf("number of pages = %d\n", number_of_pages);
+
+
+	for (retry_count = 0, page = first_page_number; page < first_page_number + number_of_pages; page++) {
+
+	  retry_all:
+		if (bus_timed_out)
+			break;
 
 		if (retry_count == 0) {
-			printf("Erasing block n° %d at adress 0x%02X (block %d of %d), %d%%\r", block, block * BLOCK_SIZE, block_nbr, number_of_blocks, percent);
+			// page_no = page / 2;
+			page_nbr = page - first_page_number + 1;
+			percent = (100 * page_nbr) / number_of_pages;
+			block_no = page / PAGES_PER_BLOCK;
+			printf("Writing page n° %d in block n° %d (page %d of %d), %d%%\r", page, block_no, page_nbr, number_of_pages, percent);
 			fflush(stdout);
-			// printf("Block address : %d (0x%02X)\n", block * BLOCK_SIZE, block * BLOCK_SIZE);
+
+			if (page % PAGES_PER_BLOCK == 0 && plane_pair(block_no, (first_page_number + PAGES_PER_BLOCK - 1) / PAGES_PER_BLOCK,
+							(first_page_number + number_of_pages) / PAGES_PER_BLOCK)) {
+				prefetch_block(image, image_size, page + PAGES_PER_BLOCK);
+				write_block_pair(image, id, block_no);
+				page += 2 * PAGES_PER_BLOCK - 1;
+				continue;
+			}
 		}
 
-	  retry:
-		read_id(id2);
-		if (memcmp(id, id2, 5) != 0) {
-			printf("\nNAND ID has changed! retrying");
-			goto retry;
+		if (page % PAGES_PER_BLOCK == 0 && retry_count == 0)
+			prefetch_block(image, image_size, page);
+		buf = image + (size_t)page * PAGE_SIZE;
+		if (block_is_bad(page / PAGES_PER_BLOCK)) {
+			cache_program_stop();
+			bbt_skipped += page % PAGES_PER_BLOCK == 0 || page == first_page_number;
+			continue;
+		}
+		if (skip_blank && retry_count == 0 && page_is_blank(buf)) {
+			cache_program_stop(); // a skipped page ends the cache program sequence
+			blank_skipped++;
+			continue;
 		}
 
-		send_eraseblock_command(block * 64); // 64 = pages per block
-		while (GPIO_READ(N_READ_BUSY) == 0) {
-			// printf("Busy\n");
-			shortpause();
+		// printf("\nwriting page n°%d\n", page);
+
+		id_checkpoint(id, 1, retry_count > 0);
+		if (program_page(page, retry_count ? page : MIN(first_page_number + number_of_pages - 1, page | (PAGES_PER_BLOCK - 1)), buf)) {
+			adapt_timing(0);
+			if (retry_count == 0) printf("\n");
+			if (retry_count < 5) {
+				printf("Failed to write page correctly! retrying\n");
+				retry_count++;
+				goto retry_all;
+			}
+			printf("Too many retries. Perhaps bad block?\n");
+			// retry_count = 0;
+		}
+		else
+			adapt_timing(1);
+		retry_count = 0;
+	}
+
+
+
+
+
+	cache_program_stop();
+	munmap(image, image_size);
+	if (bus_timed_out)
+		return -1;
+	clock_t end = clock();
+	printf("\nWrite done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	printf("Program mode:       %s\n", cache_program && cache_program_works ? "cache program (15h)" : "page program (10h)");
+	print_run_report(number_of_pages, "pages", PAGE_SIZE, &wall_start);
+	if (cache_prog_failures)
+		printf("Cache program:      %d pages failed\n", cache_prog_failures);
+	if (bbt)
+		printf("Bad blocks:         %d skipped\n", bbt_skipped);
+	if (skip_blank) {
+		struct timespec now;
+		bus_time(&now);
+		// at the pace of the pages that were programmed
+		printf("Blank pages:        %d skipped (all 0xFF), about %.3f s saved\n", blank_skipped,
+			blank_skipped < number_of_pages ?
+			elapsed_ns(&wall_start, &now) / 1e9 * blank_skipped / (number_of_pages - blank_skipped) : 0.0);
+	}
+	return 0;
+}
+
+int erase_blocks(int first_block_number, int number_of_blocks)
+{
+	int block, block_nbr, percent, retry_count;
+	unsigned char id[5];
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	if (multi_plane)
+		multi_plane = setup_multi_plane(id);
+
+	printf("\nStart erasing...\n");
+	clock_t start = clock();
+	struct timespec wall_start;
+	bus_time(&wall_start);
+
+	for (retry_count = 0, block = first_block_number; block < (first_block_number + number_of_blocks); block++) {
+
+	  retry_all:
+		if (bus_timed_out)
+			return -1;
+
+		block_nbr = block - first_block_number + 1;
+		percent = (100 * block_nbr) / number_of_blocks;
+
+		if (retry_count == 0) {
+			printf("Erasing block n° %d at adress 0x%02X (block %d of %d), %d%%\r", block, block * BLOCK_SIZE, block_nbr, number_of_blocks, percent);
+			fflush(stdout);
+			// printf("Block address : %d (0x%02X)\n", block * BLOCK_SIZE, block * BLOCK_SIZE);
+
+			if (block_is_bad(block)) {
+				bbt_skipped++;
+				continue;
+			}
+			if (plane_pair(block, first_block_number, first_block_number + number_of_blocks)) {
+				id_checkpoint(id, 2 * PAGES_PER_BLOCK, 0);
+				if (erase_block_pair(block) == 0) {
+					adapt_timing(1);
+					block++;
+					continue;
+				}
+				adapt_timing(0);
+				printf("\nFailed to erase blocks %d and %d together! erasing them one by one\n", block, block + 1);
+			}
 		}
 
+		id_checkpoint(id, PAGES_PER_BLOCK, retry_count > 0);
+		send_eraseblock_command(block * PAGES_PER_BLOCK);
+		wait_ready(WAIT_ERASE);
+
 		if (read_status()) {
+			adapt_timing(0);
 			if (retry_count == 0) printf("\n");
 			if (retry_count < 5) {
 				printf("Failed to erase block correctly! retrying\n");
@@ -980,10 +3018,1273 @@ int erase_blocks(int first_block_number, int number_of_blocks)
 			printf("Too many retries. Perhaps bad block?\n");
 			// retry_count = 0;
 		}
+		else
+			adapt_timing(1);
 		retry_count = 0;
 	}
 
 	clock_t end = clock();
 	printf("\nErasing done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	print_run_report(number_of_blocks, "blocks", BLOCK_SIZE, &wall_start);
+	if (bbt)
+		printf("Bad blocks:         %d skipped\n", bbt_skipped);
+	return 0;
+}
+
+/* differential flashing: read each block and compare it with the image, and only erase,
+   program and verify the blocks that differ. reading stops at the first differing page */
+// 0 when the block matches the image
+int diff_block(unsigned char id[5], int block, unsigned char *image, FILE *badlog)
+{
+	int page;
+	unsigned char buf[MAX_PAGE_SIZE * 2];
+
+	for (page = block * PAGES_PER_BLOCK; page < (block + 1) * PAGES_PER_BLOCK; page++) {
+		id_checkpoint(id, 1, 0);
+		if (read_page_verified(page, page, 0, buf, badlog) != 0)
+			read_page_retrying(id, page, buf, badlog);
+		if (memcmp(buf, image + (size_t)page * PAGE_SIZE, PAGE_SIZE) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+// erase block and program it from the image, 0 when both went fine
+int rewrite_block(unsigned char id[5], int block, unsigned char *image)
+{
+	int page, retry_count;
+	unsigned char *buf;
+
+	for (retry_count = 0; ; retry_count++) {
+		id_checkpoint(id, PAGES_PER_BLOCK, retry_count > 0);
+		send_eraseblock_command(block * PAGES_PER_BLOCK);
+		wait_ready(WAIT_ERASE);
+		if (read_status() == 0)
+			break;
+		printf("\nFailed to erase block %d correctly! %s\n", block, retry_count < 5 ? "retrying" : "Perhaps bad block?");
+		if (retry_count == 5)
+			return -1;
+	}
+	for (page = block * PAGES_PER_BLOCK; page < (block + 1) * PAGES_PER_BLOCK; page++) {
+		buf = image + (size_t)page * PAGE_SIZE;
+		if (page_is_blank(buf)) // it is erased already
+			continue;
+		for (retry_count = 0; ; retry_count++) {
+			id_checkpoint(id, 1, retry_count > 0);
+			if (program_page(page, page, buf) == 0)
+				break;
+			printf("\nFailed to write page %d correctly! %s\n", page, retry_count < 5 ? "retrying" : "Perhaps bad block?");
+			if (retry_count == 5)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+int flash_diff(int first_block_number, int number_of_blocks, char *infile)
+{
+	int block, block_nbr, percent, same = 0, rewritten = 0, failed = 0;
+	unsigned char id[5], *image;
+	size_t image_size;
+	FILE *badlog;
+
+	if ((badlog = fopen("bad.log", "w+")) == NULL) {
+		perror("fopen bad.log");
+		return -1;
+	}
+	image = map_image(infile, (first_block_number + number_of_blocks) * PAGES_PER_BLOCK, &image_size);
+	if (image == NULL)
+		return -1;
+
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+	printf("if this ID is incorrect, press Ctrl-C NOW to abort (3s timeout)\n");
+	sleep(3);
+
+	printf("\nStart comparing...\n");
+	clock_t start = clock();
+	struct timespec wall_start;
+	bus_time(&wall_start);
+
+	for (block = first_block_number; block < first_block_number + number_of_blocks; block++) {
+		block_nbr = block - first_block_number + 1;
+		percent = (100 * block_nbr) / number_of_blocks;
+		printf("Comparing block n° %d (block %d of %d, %d rewritten), %d%%\r", block, block_nbr, number_of_blocks, rewritten, percent);
+		fflush(stdout);
+		if (bus_timed_out)
+			break;
+
+		if (block_is_bad(block)) {
+			bbt_skipped++;
+			continue;
+		}
+		if (diff_block(id, block, image, badlog) == 0) {
+			same++;
+			continue;
+		}
+		rewritten++;
+		if (rewrite_block(id, block, image) != 0 || diff_block(id, block, image, badlog) != 0) {
+			printf("\nBlock %d does not read back as the image after rewriting it\n", block);
+			fprintf(badlog, "Block %d failed to verify after flash_diff\n", block);
+			failed++;
+		}
+	}
+
+	fcloseall();
+	munmap(image, image_size);
+	if (bus_timed_out)
+		return -1;
+	clock_t end = clock();
+	printf("\nDiff flash done in %f seconds\n", (float)(end - start) / CLOCKS_PER_SEC);
+	print_run_report(number_of_blocks, "blocks", BLOCK_SIZE, &wall_start);
+	printf("Blocks:             %d unchanged, %d rewritten, %d failed to verify\n", same, rewritten, failed);
+	if (bbt)
+		printf("Bad blocks:         %d skipped\n", bbt_skipped);
+	return failed ? -1 : 0;
+}
+
+/* the factory bad block marker: the first spare byte is not 0xFF in the first or second page
+   of the block (Samsung, Hynix) or in its last page (some Toshiba, Micron). only that byte is
+   clocked out, and clocked out again from the page register (05h-E0h) to check the bus, so a
+   block costs three tR. a mismatch loads the page again */
 
+int read_bad_block_marker(int page)
+{
+	unsigned char marker;
+
+	send_command(0x00);
+	send_column_address(page, SPARE_COLUMN);
+	send_command(0x30);
+	wait_ready(WAIT_READ);
+	read_bytes(&marker, 1);
+	return marker;
+}
+
+// the marker byte again from the page register, no tR
+int reread_bad_block_marker(void)
+{
+	unsigned char marker;
+
+	send_change_read_column(SPARE_COLUMN);
+	read_bytes(&marker, 1);
+	return marker;
+}
+
+// 1 when a page of block carries the bad block marker, -1 when the marker doesn't read stable
+int block_marked_bad(int block)
+{
+	int marker_pages[] = { 0, 1, PAGES_PER_BLOCK - 1 };
+	int i, retry_count, marker;
+
+	for (i = 0; i < 3; i++) {
+		for (retry_count = 0; ; retry_count++) {
+			marker = read_bad_block_marker(block * PAGES_PER_BLOCK + marker_pages[i]);
+			if (marker == reread_bad_block_marker()) {
+				adapt_timing(1);
+				break;
+			}
+			adapt_timing(0);
+			if (retry_count == 5)
+				return -1;
+		}
+		if (marker != 0xff)
+			return 1;
+	}
+	return 0;
+}
+
+int scan_bbt(int first_block_number, int number_of_blocks, char *outfile)
+{
+	int block, bad = 0, unstable = 0, marked;
+	unsigned char id[5], *table;
+	FILE *f;
+
+	if ((table = (unsigned char *)calloc((number_of_blocks + 7) / 8, 1)) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+
+	printf("\nScanning bad block markers...\n");
+	struct timespec wall_start;
+	bus_time(&wall_start);
+
+	for (block = first_block_number; block < first_block_number + number_of_blocks; block++) {
+		if (block % 64 == 0) {
+			printf("Scanning block n° %d, %d bad so far\r", block, bad);
+			fflush(stdout);
+		}
+		id_checkpoint(id, PAGES_PER_BLOCK, 0);
+		marked = block_marked_bad(block);
+		if (bus_timed_out) { // no table from a chip that stopped answering
+			free(table);
+			return -1;
+		}
+		if (marked == 0)
+			continue;
+		// a marker that won't read the same twice is counted bad too, better safe
+		printf("Block %d is %s\n", block, marked > 0 ? "marked bad" : "bad (marker does not read stable)");
+		table[(block - first_block_number) / 8] |= 1 << ((block - first_block_number) % 8);
+		bad++;
+		unstable += marked < 0;
+	}
+	printf("\n");
+	print_run_report(number_of_blocks, "blocks", 3, &wall_start);
+	printf("Bad blocks:         %d of %d (%d with an unstable marker)\n", bad, number_of_blocks, unstable);
+
+	if ((f = fopen(outfile, "wb")) == NULL) {
+		perror("fopen bbt file");
+		return -1;
+	}
+	if (fwrite(BBT_MAGIC, 4, 1, f) != 1 || fwrite(&first_block_number, sizeof(int), 1, f) != 1 ||
+	    fwrite(&number_of_blocks, sizeof(int), 1, f) != 1 ||
+	    fwrite(table, (number_of_blocks + 7) / 8, 1, f) != 1) {
+		perror("fwrite bbt file");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	free(table);
+	return 0;
+}
+
+int load_bbt(char *file)
+{
+	char magic[4];
+	int i, bad = 0;
+	FILE *f = fopen(file, "rb");
+
+	if (f == NULL) {
+		perror("fopen bbt file");
+		return -1;
+	}
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, BBT_MAGIC, 4) != 0 ||
+	    fread(&bbt_first, sizeof(int), 1, f) != 1 || fread(&bbt_count, sizeof(int), 1, f) != 1 ||
+	    bbt_first < 0 || bbt_count <= 0 || (bbt = (unsigned char *)malloc((bbt_count + 7) / 8)) == NULL ||
+	    fread(bbt, (bbt_count + 7) / 8, 1, f) != 1) {
+		printf("%s is not a bad block table saved by scan_bbt\n", file);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	for (i = bbt_first; i < bbt_first + bbt_count; i++)
+		bad += block_is_bad(i);
+	printf("Bad block table: %d bad blocks in blocks %d..%d\n", bad, bbt_first, bbt_first + bbt_count - 1);
+	return 0;
+}
+
+/* find the fastest stable <timing>: bisect between the command line value, which has to read
+   stable, and 0. a timing is stable when the ID and every sample page read back as they did at
+   the start, each page read twice, several rounds */
+#define CALIBRATE_ID_READS	20
+#define CALIBRATE_ROUNDS	3
+#define CALIBRATE_MARGIN	25	// percent added to the fastest stable timing
+
+int timing_is_stable(int first_page_number, int number_of_pages, unsigned char id[5], unsigned char *ref)
+{
+	int i, round;
+	unsigned char id2[5], buf[MAX_PAGE_SIZE * 2];
+
+	for (i = 0; i < CALIBRATE_ID_READS; i++) {
+		read_id_bytes(id2);
+		if (memcmp(id, id2, 5) != 0)
+			return 0;
+	}
+	for (round = 0; round < CALIBRATE_ROUNDS; round++)
+		for (i = 0; i < number_of_pages; i++)
+			if (read_page_twice(first_page_number + i, buf) != 0 ||
+			    memcmp(buf, ref + i * PAGE_SIZE, PAGE_SIZE) != 0)
+				return 0;
+	return 1;
+}
+
+int calibrate(int first_page_number, int number_of_pages, char *outfile)
+{
+	int i, lo, hi, mid, stable, result, start_scale = timing_scale;
+	unsigned char id[5], buf[MAX_PAGE_SIZE * 2], *ref;
+	FILE *f;
+
+	if (GPIO_READ(N_READ_BUSY) == 0) {
+		error_msg((char*)"N_READ_BUSY should be 1 (pulled up), but reads as 0. make sure the NAND is powered on");
+		return -1;
+	}
+	if (read_id(id) < 0)
+		return -1;
+	print_id(id);
+
+	if ((ref = (unsigned char *)malloc(number_of_pages * PAGE_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	printf("\nReading %d reference pages at %d%%...\n", number_of_pages, start_scale);
+	for (i = 0; i < number_of_pages; i++) {
+		if (read_page_twice(first_page_number + i, buf) != 0)
+			break;
+		memcpy(ref + i * PAGE_SIZE, buf, PAGE_SIZE);
+	}
+	if (i < number_of_pages || !timing_is_stable(first_page_number, number_of_pages, id, ref)) {
+		error_msg((char*)"reads are not stable at the given <timing>, start from a slower one");
+		free(ref);
+		return -1;
+	}
+
+	for (lo = 0, hi = start_scale; hi - lo > 1; ) {
+		mid = (lo + hi) / 2;
+		set_timing(&timing, mid);
+		stable = timing_is_stable(first_page_number, number_of_pages, id, ref);
+		printf("  %4d%%: %s\n", mid, stable ? "stable" : "unstable");
+		if (stable)
+			hi = mid;
+		else
+			lo = mid;
+	}
+	set_timing(&timing, start_scale);
+	free(ref);
+	if (bus_timed_out) // every timing after it read unstable, the bisection means nothing
+		return -1;
+
+	result = hi + (hi * CALIBRATE_MARGIN + 99) / 100;
+	printf("\nFastest stable timing: %d%%, use %d%% (%d%% margin)\n", hi, result, CALIBRATE_MARGIN);
+	if (outfile != NULL) {
+		if ((f = fopen(outfile, "w")) == NULL || fprintf(f, "%d\n", result) < 0) {
+			perror("save timing");
+			return -1;
+		}
+		fclose(f);
+		printf("Saved to %s, pass it as <timing>\n", outfile);
+	}
+	return 0;
+}
+
+/* NAND simulator (-B sim): gpio points at plain memory standing in for the register window, and
+   every pin change and level read goes to a model of a NAND chip. it decodes the command, address
+   and data cycles from the CLE/ALE/WE#/RE# edges, keeps R/B# low for tR/tPROG/tBERS and holds
+   the array in memory or in an image file kept between runs. time is virtual (sim_now, ns):
+   spin() and each register access move it on, so the chip can check the bus timings of its timing
+   mode and corrupt what a too fast cycle would get wrong. runs are repeatable to the bit. a
+   config file (-B sim:<file>, see nand-sim.txt) describes the chip, the default is a 1 Gbit
+   K9F1G08U0B */
+#define SIM_PLANES	4	// page registers
+#define SIM_MAX_BAD	64
+#define SIM_WB		100	// ns from the command to R/B# low
+#define SIM_SHORT_BUSY	3000	// ns, cache register moves (tRCBSY, tCBSY), plane queueing, features
+
+// timing violations the chip catches, what they cost is in sim_bus/sim_levels
+enum { SIM_WP, SIM_WH, SIM_SETUP, SIM_HOLD, SIM_ADL, SIM_RHW, SIM_WHR, SIM_RR, SIM_RP, SIM_REH,
+	SIM_REA, SIM_BUSY, SIM_CONTENTION, SIM_VIOLATIONS };
+const char *sim_violation_name[SIM_VIOLATIONS] = { "tWP", "tWH", "tCLS/tALS/tDS", "tCLH/tALH/tDH",
+	"tADL", "tRHW", "tWHR", "tRR", "tRP", "tREH", "tREA", "access while busy", "bus contention" };
+
+unsigned int sim_regs[64];	// GPFSEL and the rest, what gpio points at
+struct {
+	// chip, from the config
+	unsigned char id[8];
+	int id_len, data_size, page_size, pages_per_block, blocks, planes;
+	int t_r, t_prog, t_bers;	// ns
+	int mode, onfi;			// timing mode it meets; ONFI ones start in mode 0 until EFh
+	int nocache;			// no cache register: 31h/3Fh read the data register again, 15h is 10h
+	int hang, busies;		// busy period that never ends (clip come off), 0: none; count so far
+	int bad[SIM_MAX_BAD], bad_count;
+	int weak_bits, weak_percent;	// per page; chance each flips on a page load
+	int access_ns;			// one GPIO register access
+	unsigned int seed;
+	char *image;			// array file, NULL: memory only
+	unsigned char *array, *fresh;	// fresh: block never touched, reads erased
+	unsigned char *reg[SIM_PLANES];
+	int jedec;			// JEDEC parameter page instead of the ONFI one
+	unsigned char param[PARAM_PAGE_SIZE];
+
+	// bus
+	unsigned int pins;		// levels the host last set
+	unsigned long long we_fall, we_rise, re_fall, re_rise, data_change, cle_change, ale_change;
+	unsigned long long latched, busy_from, busy_until, array_until;
+	int latch_kind;			// 0: command, 1: address, 2: data in
+	int last_input;			// register byte the last data cycle wrote, -1: none
+	unsigned char drive, driven;	// byte on the bus after tREA, and before it
+
+	// command state
+	int cmd, addr[5], naddr, plane, column, out;
+	int out_before_status;		// what 00h goes back to after 70h
+	int row, row_set;		// row of the last 5 address cycle sequence not used yet
+	int queue[SIM_PLANES], queued;	// rows of 60h, 32h and 11h
+	int cache_next;			// page in the data register during a cache read, -1: none
+	int fail, failc, mode_now;
+	unsigned char feature[4];
+	int nfeature;
+
+	// counters
+	int loads, programs, erases, violations[SIM_VIOLATIONS];
+} sim;
+
+enum { SIM_OUT_NONE, SIM_OUT_ID, SIM_OUT_ONFI, SIM_OUT_JEDEC, SIM_OUT_PARAM, SIM_OUT_STATUS, SIM_OUT_PAGE };
+
+inline unsigned int sim_random(void)
+{
+	sim.seed ^= sim.seed << 13;
+	sim.seed ^= sim.seed >> 17;
+	sim.seed ^= sim.seed << 5;
+	return sim.seed;
+}
+
+inline unsigned int sim_hash(unsigned int x)
+{
+	x = (x ^ (x >> 16)) * 0x45d9f3b;
+	x = (x ^ (x >> 16)) * 0x45d9f3b;
+	return x ^ (x >> 16);
+}
+
+// count a violation, and what the byte it hit reads as
+inline unsigned char sim_violation(int kind, unsigned char byte)
+{
+	sim.violations[kind]++;
+	return byte ^ (1 << (sim_random() & 7));
+}
+
+inline int sim_pin(int g)
+{
+	return (sim.pins >> g) & 1;
+}
+
+inline unsigned char sim_data(unsigned int pins)
+{
+	unsigned char d = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		d |= ((pins >> data_to_gpio_map[i]) & 1) << i;
+	return d;
+}
+
+inline int sim_ready(void)
+{
+	return sim_now < sim.busy_from || sim_now >= sim.busy_until;
+}
+
+// R/B# low for ns from tWB after the command, after whatever the array still does
+void sim_busy(int ns, int array)
+{
+	sim.busy_from = sim_now + SIM_WB;
+	sim.busy_until = MAX(sim.busy_from, array ? sim.array_until : 0) + ns;
+	if (++sim.busies == sim.hang)
+		sim.busy_until = ~0ULL;
+	if (array)
+		sim.array_until = sim.busy_until;
+}
+
+inline unsigned char *sim_page(int row)
+{
+	return sim.array + (unsigned long long)row * sim.page_size;
+}
+
+inline int sim_block_bad(int block)
+{
+	int i;
+
+	for (i = 0; i < sim.bad_count; i++)
+		if (sim.bad[i] == block)
+			return 1;
+	return 0;
+}
+
+// row inside the chip (the address bits above it are ignored), and its block made writable memory
+inline int sim_row(int row)
+{
+	return row % (sim.blocks * sim.pages_per_block);
+}
+
+void sim_touch(int block)
+{
+	if (sim.fresh[block]) {
+		memset(sim_page(block * sim.pages_per_block), 0xff, (size_t)sim.page_size * sim.pages_per_block);
+		sim.fresh[block] = 0;
+	}
+}
+
+inline int sim_plane(int row)
+{
+	return (row / sim.pages_per_block) % sim.planes;
+}
+
+// array to page register, weak bits may flip on the way
+void sim_load(int row)
+{
+	unsigned char *reg = sim.reg[sim_plane(row)];
+	unsigned int bit;
+	int i;
+
+	row = sim_row(row);
+	if (sim.fresh[row / sim.pages_per_block])
+		memset(reg, 0xff, sim.page_size);
+	else
+		memcpy(reg, sim_page(row), sim.page_size);
+	for (i = 0; i < sim.weak_bits; i++)
+		if ((int)(sim_random() % 100) < sim.weak_percent) {
+			bit = sim_hash(row * 131 + i) % (sim.page_size * 8);
+			reg[bit / 8] ^= 1 << (bit % 8);
+		}
+	sim.loads++;
+}
+
+// page register to array: bits only go from 1 to 0. 1 when it failed
+int sim_program(int row)
+{
+	unsigned char *reg = sim.reg[sim_plane(row)], *page;
+	int i;
+
+	row = sim_row(row);
+	if (!sim_pin(N_WRITE_PROTECT) || sim_block_bad(row / sim.pages_per_block))
+		return 1;
+	sim_touch(row / sim.pages_per_block);
+	page = sim_page(row);
+	for (i = 0; i < sim.page_size; i++)
+		page[i] &= reg[i];
+	sim.programs++;
+	return 0;
+}
+
+int sim_erase(int row)
+{
+	int block = sim_row(row) / sim.pages_per_block;
+
+	if (!sim_pin(N_WRITE_PROTECT) || sim_block_bad(block))
+		return 1;
+	sim.fresh[block] = 0;
+	memset(sim_page(block * sim.pages_per_block), 0xff, (size_t)sim.page_size * sim.pages_per_block);
+	sim.erases++;
+	return 0;
+}
+
+void sim_command(int c)
+{
+	int i, fail;
+
+	sim.cmd = c;
+	sim.naddr = 0;
+	switch (c) {
+	case 0x30: // read, with the rows 60h/32h queued for the other planes
+		for (i = 0; i < sim.queued; i++)
+			sim_load(sim.queue[i]);
+		if (sim.row_set)
+			sim_load(sim.row);
+		else if (sim.queued)
+			sim.row = sim.queue[0], sim.column = 0;
+		sim.plane = sim_plane(sim.row);
+		sim.cache_next = sim.row;
+		sim.queued = sim.row_set = 0;
+		sim.out = SIM_OUT_PAGE;
+		sim_busy(sim.t_r, 1);
+		break;
+	case 0x32: // ONFI multi-plane read queue
+		if (sim.row_set && sim.queued < SIM_PLANES)
+			sim.queue[sim.queued++] = sim.row;
+		sim.row_set = 0;
+		sim_busy(SIM_SHORT_BUSY, 0);
+		break;
+	case 0x31: // cache read: data register to cache register, next page to the data register
+	case 0x3F:
+		if (sim.cache_next < 0)
+			break;
+		if (sim.nocache) {
+			sim.column = 0;
+			sim.out = SIM_OUT_PAGE;
+			break;
+		}
+		sim_busy(SIM_SHORT_BUSY, 1);
+		sim_load(sim.cache_next);
+		sim.plane = sim_plane(sim.cache_next);
+		sim.column = 0;
+		sim.out = SIM_OUT_PAGE;
+		if (c == 0x31) {
+			sim.cache_next++;
+			sim.array_until += sim.t_r;
+		}
+		else
+			sim.cache_next = -1;
+		break;
+	case 0xE0: // 05h/06h random data output
+		if (sim.row_set) // 00h or 06h with a row: that plane's register
+			sim.plane = sim_plane(sim.row);
+		sim.row_set = 0;
+		sim.out = SIM_OUT_PAGE;
+		break;
+	case 0x11: // multi-plane program queue
+		if (sim.row_set && sim.queued < SIM_PLANES)
+			sim.queue[sim.queued++] = sim.row;
+		sim.row_set = 0;
+		sim_busy(SIM_SHORT_BUSY, 0);
+		break;
+	case 0x10: // program, the queued planes too
+	case 0x15: // cache program: ready again once the cache register is free
+		fail = 0;
+		for (i = 0; i < sim.queued; i++)
+			fail |= sim_program(sim.queue[i]);
+		if (sim.row_set)
+			fail |= sim_program(sim.row);
+		sim.queued = sim.row_set = 0;
+		sim.failc = sim.fail;
+		sim.fail = fail;
+		if (c == 0x10 || sim.nocache)
+			sim_busy(sim.t_prog, 1);
+		else {
+			sim_busy(SIM_SHORT_BUSY, 1);
+			sim.array_until += sim.t_prog;
+		}
+		break;
+	case 0xD1: // ONFI multi-plane erase queue
+		sim_busy(SIM_SHORT_BUSY, 0);
+		break;
+	case 0xD0:
+		fail = 0;
+		for (i = 0; i < sim.queued; i++)
+			fail |= sim_erase(sim.queue[i]);
+		sim.queued = 0;
+		sim.fail = fail;
+		sim_busy(sim.t_bers, 1);
+		break;
+	case 0x70:
+		if (sim.out != SIM_OUT_STATUS)
+			sim.out_before_status = sim.out;
+		sim.out = SIM_OUT_STATUS;
+		break;
+	case 0xFF:
+		sim.queued = sim.row_set = 0;
+		sim.cache_next = -1;
+		sim.out = SIM_OUT_NONE;
+		sim_busy(SIM_SHORT_BUSY, 1);
+		break;
+	case 0x00: // a new row follows, or back from status to data output
+		if (sim.out == SIM_OUT_STATUS)
+			sim.out = sim.out_before_status;
+		// fall through
+	case 0x06:
+	case 0x60:
+	case 0x80: // data input, 81h: Samsung/Hynix second plane
+	case 0x81:
+		sim.row_set = 0;
+		break;
+	}
+}
+
+void sim_address(int byte)
+{
+	if (sim.naddr < 5)
+		sim.addr[sim.naddr++] = byte;
+	switch (sim.cmd) {
+	case 0x00: case 0x06: case 0x80: case 0x81:
+		if (sim.naddr < 5)
+			return;
+		sim.column = sim.addr[0] | sim.addr[1] << 8;
+		sim.row = sim.addr[2] | sim.addr[3] << 8 | sim.addr[4] << 16;
+		sim.row_set = 1;
+		sim.plane = sim_plane(sim.row);
+		if (sim.cmd >= 0x80) // the register of that plane starts out erased
+			memset(sim.reg[sim.plane], 0xff, sim.page_size);
+		sim.last_input = -1;
+		break;
+	case 0x05: case 0x85:
+		if (sim.naddr == 2)
+			sim.column = sim.addr[0] | sim.addr[1] << 8;
+		break;
+	case 0x60:
+		if (sim.naddr == 3 && sim.queued < SIM_PLANES)
+			sim.queue[sim.queued++] = sim.addr[0] | sim.addr[1] << 8 | sim.addr[2] << 16;
+		break;
+	case 0x90:
+		sim.out = byte == 0x20 && sim.onfi ? SIM_OUT_ONFI : byte == 0x40 && sim.jedec ? SIM_OUT_JEDEC : SIM_OUT_ID;
+		sim.column = 0;
+		break;
+	case 0xEC:
+		sim.out = (sim.onfi && byte == 0) || (sim.jedec && byte == 0x40) ? SIM_OUT_PARAM : SIM_OUT_NONE;
+		sim.column = 0;
+		sim_busy(sim.t_r, 1);
+		break;
+	case 0xEF:
+		sim.nfeature = 0;
+		break;
+	}
+}
+
+void sim_data_in(unsigned char byte)
+{
+	switch (sim.cmd) {
+	case 0x80: case 0x81: case 0x85:
+		if (sim.column < sim.page_size) {
+			sim.reg[sim.plane][sim.column] = byte;
+			sim.last_input = sim.column;
+		}
+		sim.column++;
+		break;
+	case 0xEF:
+		if (sim.nfeature < 4)
+			sim.feature[sim.nfeature++] = byte;
+		if (sim.nfeature == 4) {
+			if (sim.addr[0] == 0x01 && sim.feature[0] <= sim.mode)
+				sim.mode_now = sim.feature[0];
+			sim_busy(SIM_SHORT_BUSY, 1);
+		}
+		break;
+	}
+}
+
+// the byte the chip puts out on RE# low
+unsigned char sim_output(void)
+{
+	int i = sim.column;
+
+	switch (sim.out) {
+	case SIM_OUT_ID:
+		return sim.id[i % sim.id_len];
+	case SIM_OUT_ONFI:
+		return i < 4 ? "ONFI"[i] : 0;
+	case SIM_OUT_JEDEC:
+		return i < 5 ? "JEDEC"[i] : 0;
+	case SIM_OUT_PARAM:
+		return sim.param[i % param_page_size(sim.jedec ? PARAM_JEDEC : PARAM_ONFI)];
+	case SIM_OUT_STATUS:
+		return (sim_pin(N_WRITE_PROTECT) ? 0x80 : 0) | (sim_ready() ? 0x40 : 0) |
+		       (sim_ready() && sim_now >= sim.array_until ? 0x20 : 0) | sim.failc << 1 | sim.fail;
+	case SIM_OUT_PAGE:
+		return i < sim.page_size ? sim.reg[sim.plane][i] : 0xff;
+	}
+	return 0;
+}
+
+// the host changed the pins of mask to values, with accesses register writes
+void sim_bus(unsigned int mask, unsigned int values, int accesses)
+{
+	struct nand_timing *t = &onfi_timing_mode[sim.mode_now];
+	unsigned int old = sim.pins, changed, data_mask = data_out_set[0xff];
+	unsigned char byte;
+
+	sim_now += accesses * sim.access_ns;
+	sim.pins = (old & ~mask) | (values & mask);
+	changed = old ^ sim.pins;
+
+	if (changed & (data_mask | 1u << COMMAND_LATCH_ENABLE | 1u << ADDRESS_LATCH_ENABLE)) {
+		if (changed & data_mask)
+			sim.data_change = sim_now;
+		if (changed & (1u << COMMAND_LATCH_ENABLE))
+			sim.cle_change = sim_now;
+		if (changed & (1u << ADDRESS_LATCH_ENABLE))
+			sim.ale_change = sim_now;
+		if (sim.we_rise && (((changed & data_mask) && sim_now - sim.we_rise < (unsigned)t->tDH) ||
+		    ((changed & (1u << COMMAND_LATCH_ENABLE)) && sim_now - sim.we_rise < (unsigned)t->tCLH) ||
+		    ((changed & (1u << ADDRESS_LATCH_ENABLE)) && sim_now - sim.we_rise < (unsigned)t->tALH))) {
+			// the last cycle may have latched the new levels
+			sim.violations[SIM_HOLD]++;
+			if (sim.latch_kind == 2 && sim.last_input >= 0 && (changed & data_mask))
+				sim.reg[sim.plane][sim.last_input] = sim_data(sim.pins);
+		}
+	}
+
+	if (changed & (1u << N_WRITE_ENABLE)) {
+		if (!sim_pin(N_WRITE_ENABLE)) {
+			if (sim.we_rise && sim_now - sim.we_rise < (unsigned)t->tWH)
+				sim.violations[SIM_WH]++;
+			if (sim.re_rise > sim.we_rise && sim_now - sim.re_rise < (unsigned)t->tRHW)
+				sim.violations[SIM_RHW]++;
+			sim.we_fall = sim_now;
+		}
+		else {
+			byte = sim_data(sim.pins);
+			if (sim_now - sim.we_fall < (unsigned)t->tWP)
+				byte = sim_violation(SIM_WP, byte);
+			if (sim_now - sim.data_change < (unsigned)t->tDS ||
+			    (sim_pin(COMMAND_LATCH_ENABLE) && sim_now - sim.cle_change < (unsigned)t->tCLS) ||
+			    (sim_pin(ADDRESS_LATCH_ENABLE) && sim_now - sim.ale_change < (unsigned)t->tALS))
+				byte = sim_violation(SIM_SETUP, byte);
+			if (!sim_ready() && !(sim_pin(COMMAND_LATCH_ENABLE) && (byte == 0x70 || byte == 0xFF)))
+				byte = sim_violation(SIM_BUSY, byte);
+			sim.we_rise = sim_now;
+			if (sim_pin(COMMAND_LATCH_ENABLE)) {
+				sim_command(byte);
+				sim.latch_kind = 0;
+			}
+			else if (sim_pin(ADDRESS_LATCH_ENABLE)) {
+				sim_address(byte);
+				sim.latch_kind = 1;
+			}
+			else {
+				if (sim.latch_kind == 1 && sim_now - sim.latched < (unsigned)t->tADL)
+					byte = sim_violation(SIM_ADL, byte);
+				sim_data_in(byte);
+				sim.latch_kind = 2;
+			}
+			sim.latched = sim_now;
+		}
+	}
+
+	if (changed & (1u << N_READ_ENABLE)) {
+		if (!sim_pin(N_READ_ENABLE)) {
+			sim.driven = sim.drive;
+			byte = sim_output();
+			if (sim.re_rise && sim_now - sim.re_rise < (unsigned)t->tREH)
+				byte = sim_violation(SIM_REH, byte);
+			if (sim.latch_kind != 3 && sim_now - sim.latched < (unsigned)t->tWHR)
+				byte = sim_violation(SIM_WHR, byte);
+			if (sim.out != SIM_OUT_STATUS) {
+				if (!sim_ready())
+					byte = sim_violation(SIM_BUSY, byte);
+				else if (sim.busy_until > sim.latched && sim_now - sim.busy_until < (unsigned)t->tRR)
+					byte = sim_violation(SIM_RR, byte);
+			}
+			sim.drive = byte;
+			sim.latch_kind = 3;
+			sim.re_fall = sim_now;
+		}
+		else {
+			if (sim_now - sim.re_fall < (unsigned)t->tRP)
+				sim.violations[SIM_RP]++;
+			if (sim.out != SIM_OUT_STATUS)
+				sim.column++;
+			sim.re_rise = sim_now;
+		}
+	}
+}
+
+// what GPLEV0 reads: the host's levels, R/B#, and the chip's byte while RE# is low
+unsigned int sim_levels(void)
+{
+	struct nand_timing *t = &onfi_timing_mode[sim.mode_now];
+	unsigned int lev, data_mask = data_out_set[0xff], g = data_to_gpio_map[0];
+
+	sim_now += sim.access_ns;
+	lev = sim.pins & ~(1u << N_READ_BUSY);
+	if (sim_ready())
+		lev |= 1u << N_READ_BUSY;
+	if (!sim_pin(N_READ_ENABLE) && sim.out != SIM_OUT_NONE) {
+		if (((sim_regs[g / 10] >> ((g % 10) * 3)) & 7) == 1)
+			sim.violations[SIM_CONTENTION]++;
+		lev &= ~data_mask;
+		if (sim_now - sim.re_fall < (unsigned)t->tREA) {
+			sim.violations[SIM_REA]++;
+			lev |= data_out_set[sim.driven];
+		}
+		else
+			lev |= data_out_set[sim.drive];
+	}
+	return lev;
+}
+
+void sim_report(void)
+{
+	int i, any = 0;
+
+	printf("Simulator:          %.6f s of bus time, %d page loads, %d programs, %d erases, violations:",
+		sim_now / 1e9, sim.loads, sim.programs, sim.erases);
+	for (i = 0; i < SIM_VIOLATIONS; i++)
+		if (sim.violations[i]) {
+			printf(" %s %d", sim_violation_name[i], sim.violations[i]);
+			any = 1;
+		}
+	printf(any ? "\n" : " none\n");
+}
+
+inline void sim_put16(unsigned char *p, int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+inline void sim_put32(unsigned char *p, int v)
+{
+	sim_put16(p, v);
+	sim_put16(p + 2, v >> 16);
+}
+
+// what an ONFI 1.0 or JEDEC chip of this geometry puts in its parameter page (see param_page_geometry)
+void sim_param_page(void)
+{
+	unsigned char *p = sim.param;
+	int size = param_page_size(sim.jedec ? PARAM_JEDEC : PARAM_ONFI);
+
+	memset(p, 0, size);
+	memcpy(p, sim.jedec ? "JESD" : "ONFI", 4);
+	sim_put16(p + 4, 0x02);
+	memcpy(p + 32, "SIMULATED   ", 12);
+	memcpy(p + 44, "rpi-raw-nand -B sim ", 20);
+	p[64] = sim.id[0];
+	sim_put32(p + 80, sim.data_size);
+	sim_put16(p + 84, sim.page_size - sim.data_size);
+	sim_put32(p + 92, sim.pages_per_block);
+	sim_put32(p + 96, sim.blocks);
+	p[100] = 1;
+	p[101] = 0x23;	// 3 row, 2 column address cycles
+	sim_put16(p + (sim.jedec ? 144 : 129), (2 << sim.mode) - 1);
+	sim_put16(p + size - 2, param_page_crc(p, size));
+}
+
+// chip description, one setting per line (see nand-sim.txt)
+int sim_config(char *file)
+{
+	FILE *f = fopen(file, "r");
+	char line[256], key[32], *s;
+	int n, v, lineno = 0;
+
+	if (f == NULL) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if ((s = strchr(line, '#')) != NULL)
+			*s = 0;
+		if (sscanf(line, "%31s%n", key, &n) != 1)
+			continue;
+		s = line + n;
+		if (strcmp(key, "id") == 0) {
+			for (sim.id_len = 0; sim.id_len < 8 && sscanf(s, "%x%n", &v, &n) == 1; sim.id_len++, s += n)
+				sim.id[sim.id_len] = v;
+			if (sim.id_len == 0)
+				goto bad;
+		}
+		else if (strcmp(key, "geometry") == 0) {
+			if (sscanf(s, "%d %d %d %d", &sim.data_size, &v, &sim.pages_per_block, &sim.blocks) != 4 ||
+			    sim.data_size <= 0 || v < 0 || sim.data_size + v > MAX_PAGE_SIZE ||
+			    sim.pages_per_block <= 0 || sim.blocks <= 0)
+				goto bad;
+			sim.page_size = sim.data_size + v;
+		}
+		else if (strcmp(key, "times") == 0) {
+			if (sscanf(s, "%d %d %d", &sim.t_r, &sim.t_prog, &sim.t_bers) != 3)
+				goto bad;
+			sim.t_r *= 1000;
+			sim.t_prog *= 1000;
+			sim.t_bers *= 1000;
+		}
+		else if (strcmp(key, "mode") == 0) {
+			if (sscanf(s, "%d", &sim.mode) != 1 || sim.mode < 0 || sim.mode > 5)
+				goto bad;
+		}
+		else if (strcmp(key, "onfi") == 0)
+			sim.onfi = 1;
+		else if (strcmp(key, "jedec") == 0)
+			sim.jedec = 1;
+		else if (strcmp(key, "nocache") == 0)
+			sim.nocache = 1;
+		else if (strcmp(key, "hang") == 0) {
+			if (sscanf(s, "%d", &sim.hang) != 1 || sim.hang < 1)
+				goto bad;
+		}
+		else if (strcmp(key, "bad") == 0) {
+			for (; sim.bad_count < SIM_MAX_BAD && sscanf(s, "%d%n", &v, &n) == 1; s += n)
+				sim.bad[sim.bad_count++] = v;
+		}
+		else if (strcmp(key, "weak") == 0) {
+			if (sscanf(s, "%d %d", &sim.weak_bits, &sim.weak_percent) != 2)
+				goto bad;
+		}
+		else if (strcmp(key, "seed") == 0) {
+			if (sscanf(s, "%u", &sim.seed) != 1 || sim.seed == 0)
+				goto bad;
+		}
+		else if (strcmp(key, "access") == 0) {
+			if (sscanf(s, "%d", &sim.access_ns) != 1 || sim.access_ns <= 0)
+				goto bad;
+		}
+		else if (strcmp(key, "image") == 0) {
+			if (sscanf(s, "%255s", line) != 1)
+				goto bad;
+			sim.image = strdup(line);
+		}
+		else
+			goto bad;
+	}
+	fclose(f);
+	return 0;
+bad:
+	printf("%s:%d: bad line\n", file, lineno);
+	fclose(f);
+	return -1;
+}
+
+int init_sim(char *config)
+{
+	static const unsigned char k9f1g08u0b[5] = { 0xEC, 0xF1, 0x00, 0x95, 0x40 };
+	struct stat st;
+	size_t block_bytes, size;
+	int fd, i, block;
+
+	memcpy(sim.id, k9f1g08u0b, 5);
+	sim.id_len = 5;
+	sim.data_size = 2048;
+	sim.page_size = 2048 + 64;
+	sim.pages_per_block = 64;
+	sim.blocks = 1024;
+	sim.t_r = 25000;
+	sim.t_prog = 200000;
+	sim.t_bers = 1500000;
+	sim.mode = 4;
+	sim.seed = 1;
+	sim.access_ns = 15;
+	if (config != NULL && sim_config(config) < 0)
+		return -1;
+	if (sim.onfi && sim.jedec) {
+		printf("%s: onfi or jedec, not both\n", config);
+		return -1;
+	}
+	// planes as the 5th ID byte tells (see setup_multi_plane)
+	sim.planes = sim.id_len < 5 ? 1 : MIN(1 << ((sim.id[4] >> 2) & 3), SIM_PLANES);
+
+	block_bytes = (size_t)sim.page_size * sim.pages_per_block;
+	size = block_bytes * sim.blocks;
+	sim.fresh = (unsigned char *)malloc(sim.blocks);
+	for (i = 0; i < sim.planes; i++)
+		sim.reg[i] = (unsigned char *)malloc(MAX_PAGE_SIZE);
+	if (sim.image == NULL) {
+		sim.array = (unsigned char *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+						  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		memset(sim.fresh, 1, sim.blocks);
+	}
+	else {
+		if ((fd = open(sim.image, O_RDWR|O_CREAT, 0644)) < 0 || fstat(fd, &st) < 0 ||
+		    ftruncate(fd, size) < 0) {
+			perror(sim.image);
+			return -1;
+		}
+		sim.array = (unsigned char *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		// blocks the file did not hold yet start out erased
+		memset(sim.fresh, 0, sim.blocks);
+		for (block = st.st_size / block_bytes; block < sim.blocks; block++)
+			sim.fresh[block] = 1;
+	}
+	if (sim.array == MAP_FAILED) {
+		perror("simulated NAND array");
+		return -1;
+	}
+	for (block = 0; sim.image != NULL && block < sim.blocks; block++)
+		sim_touch(block);
+	// factory bad block markers, first spare byte of the first two pages
+	for (i = 0; i < sim.bad_count; i++)
+		if ((block = sim.bad[i]) >= 0 && block < sim.blocks) {
+			sim_touch(block);
+			sim_page(block * sim.pages_per_block)[sim.data_size] = 0;
+			sim_page(block * sim.pages_per_block + 1)[sim.data_size] = 0;
+		}
+	if (sim.onfi || sim.jedec)
+		sim_param_page();
+	sim.mode_now = sim.onfi ? 0 : sim.mode;
+	sim.cache_next = sim.last_input = -1;
+	sim.pins = 1u << N_READ_ENABLE | 1u << N_WRITE_ENABLE;
+	sim_now = 1000000;
+	gpio = sim_regs;
+	atexit(sim_report);
+
+	printf("Simulated NAND: ID");
+	for (i = 0; i < sim.id_len; i++)
+		printf(" %02X", sim.id[i]);
+	printf(", %d + %d bytes per page, %d pages per block, %d blocks, %d plane(s)%s%s\n", sim.data_size,
+		sim.page_size - sim.data_size, sim.pages_per_block, sim.blocks, sim.planes,
+		sim.onfi ? ", ONFI" : sim.jedec ? ", JEDEC" : "",
+		sim.nocache ? ", no cache register" : "");
+	printf("                tR %d us, tPROG %d us, tBERS %d us, timing mode %d, %d bad blocks, %d weak bits/page (%d%%)%s%s\n\n",
+		sim.t_r / 1000, sim.t_prog / 1000, sim.t_bers / 1000, sim.mode, sim.bad_count, sim.weak_bits,
+		sim.weak_percent, sim.image ? ", image " : "", sim.image ? sim.image : "");
+	return 0;
+}
+
+/* data bus code against an in-memory copy of the GPIO register window, no NAND (nor root) needed */
+DEFINE_STATIC_BUS(bench_scattered, 23, 24, 25, 8, 7, 10, 9, 11)
+DEFINE_STATIC_BUS(bench_split, 8, 9, 10, 11, 20, 21, 22, 23)
+DEFINE_STATIC_BUS(bench_contiguous, 8, 9, 10, 11, 12, 13, 14, 15)
+
+int bench_map[3][8] = {
+	{ 23, 24, 25, 8, 7, 10, 9, 11 },	// rpi-tsop48-nand-v1 and -b3
+	{ 8, 9, 10, 11, 20, 21, 22, 23 },	// two runs of four
+	{ 8, 9, 10, 11, 12, 13, 14, 15 },	// rpi-raw-nand-v3
+};
+const char *bench_map_name[3] = { "scattered (v1/b3)", "split nibbles", "contiguous (v3)" };
+int (*bench_static_in[3])(void) = { bench_scattered_in, bench_split_in, bench_contiguous_in };
+void (*bench_static_out[3])(int) = { bench_scattered_out, bench_split_out, bench_contiguous_out };
+
+// count mismatches of in() / out() against bit by bit access on the current data_to_gpio_map
+int check_bus(int (*in)(void), void (*out)(int), volatile unsigned int *regs)
+{
+	int i, errors = 0;
+	unsigned int lev, seed = 1, all = 0;
+
+	for (i = 0; i < 8; i++)
+		all |= 1u << data_to_gpio_map[i];
+	// GPLEV0 decode: random pin levels
+	for (i = 0; i < 65536; i++) {
+		seed = seed * 1103515245 + 12345;
+		regs[13] = seed;
+		if (in() != data8_in_bits())
+			errors++;
+	}
+	// GPSET0/GPCLR0: apply to random pin levels and decode back bit by bit, other pins must not move
+	for (i = 0; i < 256; i++) {
+		seed = seed * 1103515245 + 12345;
+		lev = seed;
+		out(i);
+		regs[13] = (lev | regs[7]) & ~regs[10];
+		if (data8_in_bits() != i || ((regs[13] ^ lev) & ~all) != 0)
+			errors++;
+	}
+	return errors;
+}
+
+/* control lines of a NAND that may sit on the bus while bench_bus toggles the data lines: WE# and
+   RE# high, CLE and ALE low, WP# low, so that it latches nothing. there is no CE# line (tied low
+   on the boards), levels go out before the lines turn outputs. out 0 turns them back into inputs */
+void bench_control_lines(int out)
+{
+	static const int high[] = { N_WRITE_ENABLE, N_READ_ENABLE };
+	static const int low[] = { COMMAND_LATCH_ENABLE, ADDRESS_LATCH_ENABLE, N_WRITE_PROTECT };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		GPIO_SET_1(high[i]);
+		if (out)
+			OUT_GPIO(high[i]);
+		else
+			INP_GPIO(high[i]);
+	}
+	for (i = 0; i < 3; i++) {
+		GPIO_SET_0(low[i]);
+		if (out)
+			OUT_GPIO(low[i]);
+		else
+			INP_GPIO(low[i]);
+	}
+}
+
+// hardware: the backend -B gave, whose real pins get timed too, -1 for none
+int bench_bus(int hardware)
+{
+	static unsigned int fake_gpio[1024];
+	void *regs = MAP_FAILED;
+	int (*in[3])(void) = { data8_in_bits, data8_in_table, NULL };
+	void (*out[3])(int) = { data8_out_bits, data8_out_table, NULL };
+	const char *profile[3] = { "pin by pin", "tables", "static" };
+	int board_map[8], m, p, i, errors, total_errors = 0, mem_fd;
+	volatile int sink = 0;
+	struct timespec t0, t1;
+	const int n = 1 << 20;
+
+	memcpy(board_map, data_to_gpio_map, sizeof(board_map));
+	gpio = fake_gpio;
+	gpio_backend = GPIO_MEM;
+
+	errors = check_bus(data8_static_in, data8_static_out, fake_gpio);
+	printf("board pinout: static code %s pin by pin access (%d errors)\n",
+		errors ? "DOES NOT match" : "matches", errors);
+	total_errors += errors;
+
+	printf("RAM register window: figures count CPU work only, peripheral latency comes on top\n\n");
+	for (m = 0; m < 3; m++) {
+		memcpy(data_to_gpio_map, bench_map[m], sizeof(data_to_gpio_map));
+		init_data_bus(data_to_gpio_map);
+		in[2] = bench_static_in[m];
+		out[2] = bench_static_out[m];
+
+		printf("%s pinout:\n", bench_map_name[m]);
+		for (p = 0; p < 3; p++) {
+			errors = p ? check_bus(in[p], out[p], fake_gpio) : 0;
+			total_errors += errors;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (i = 0; i < n; i++)
+				out[p](i);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			printf("  %-10s write %6.2f ns/byte, ", profile[p], elapsed_ns(&t0, &t1) / n);
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (i = 0; i < n; i++)
+				sink += in[p]();
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			printf("read %6.2f ns/byte", elapsed_ns(&t0, &t1) / n);
+			if (p)
+				printf(", %s pin by pin access (%d errors)", errors ? "DOES NOT match" : "matches", errors);
+			printf("\n");
+		}
+	}
+
+	memcpy(data_to_gpio_map, board_map, sizeof(data_to_gpio_map));
+	init_data_bus(data_to_gpio_map);
+	init_data_direction();
+
+	// command overhead per page, without any pause: read command + data bus turnaround + status
+	printf("\nper page command overhead (board pinout):\n");
+	set_timing(&timing, 0);
+	for (p = 0; p < 2; p++) {
+		data_dir_cached = p;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < n / 64; i++) {
+			send_read_command(i);
+			set_data_direction_in();
+			sink += read_status();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("  %-25s %8.1f ns/page\n", p ? "cached GPFSEL images" : "read-modify-write per pin",
+			elapsed_ns(&t0, &t1) / (n / 64));
+	}
+
+	// the same data byte moves through the backends. real pins only for the one -B names: GPIO_BASE
+	// is the Pi 2/3 one and gpiochip0 any SoC's first, neither is safe to poke unasked. mem runs on
+	// the RAM window otherwise, a baseline without any peripheral latency. only the data lines toggle
+	printf("\nGPIO backends (board pinout, static bus code):\n");
+	if (hardware == GPIO_MEM) {
+		if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0)
+			perror("open /dev/mem");
+		else {
+			if ((regs = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, GPIO_BASE)) == MAP_FAILED)
+				perror("mmap GPIO_BASE");
+			close(mem_fd);
+		}
+	}
+	if (regs != MAP_FAILED) {
+		gpio = (volatile unsigned int *)regs;
+		init_data_direction();
+		bench_control_lines(1);
+	}
+	set_data_direction_out();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++)
+		GPIO_DATA8_OUT(i);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("  %-5s write %9.2f ns/byte, ", "mem", elapsed_ns(&t0, &t1) / n);
+	set_data_direction_in();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++)
+		sink += GPIO_DATA8_IN();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("read %9.2f ns/byte (%s)\n", elapsed_ns(&t0, &t1) / n,
+		regs != MAP_FAILED ? "/dev/mem" : hardware == GPIO_MEM ? "RAM baseline, no registers" :
+		"RAM baseline, -B mem for the registers");
+	if (regs != MAP_FAILED) {
+		bench_control_lines(0);
+		munmap(regs, 4096);
+		gpio = fake_gpio;
+	}
+	if (hardware != GPIO_CHIP)
+		printf("  chip  not timed, -B chip for " GPIOCHIP_DEV "\n");
+	else if (init_gpio_chip() == 0) {
+		gpio_backend = GPIO_CHIP;
+		init_data_direction();
+		bench_control_lines(1);
+		set_data_direction_out();
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < n / 256; i++)
+			GPIO_DATA8_OUT(i);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("  %-5s write %9.2f ns/byte, ", "chip", elapsed_ns(&t0, &t1) / (n / 256));
+		set_data_direction_in();
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < n / 256; i++)
+			sink += GPIO_DATA8_IN();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("read %9.2f ns/byte (" GPIOCHIP_DEV ")\n", elapsed_ns(&t0, &t1) / (n / 256));
+		bench_control_lines(0);
+		close(gpio_line_fd);
+		gpio_line_fd = -1;
+		gpio_backend = GPIO_MEM;
+	}
+	else
+		printf("  chip  not available here\n");
+	return total_errors ? -1 : 0;
 }
@@ -30,6 +30,7 @@
 #include <time.h>
 
 // #define DEBUG 1
+#define FAST_BUS 1 // byte wide data bus through lookup tables, comment out to access data pins one by one
 
 #define PAGE_SIZE 2112 // (2K + 64)Byte
 #define BLOCK_SIZE 135168 // (2K + 64)Byte
@@ -123,13 +124,69 @@ inline void set_data_direction_out(void)
 		OUT_GPIO(data_to_gpio_map[i]);
 }
 
-inline int GPIO_DATA8_IN(void)
+inline int data8_in_bits(void)
 {
 	int i, data;
 	for (i = data = 0; i < 8; i++, data = data << 1) {
 		data |= GPIO_READ(data_to_gpio_map[7 - i]);
 	}
-	data >>= 1;
+	return data >> 1;
+}
+
+inline void data8_out_bits(int data)
+{
+	int i;
+	for (i = 0; i < 8; i++, data >>= 1) {
+		if (data & 1)
+			GPIO_SET_1(data_to_gpio_map[i]);
+		else
+			GPIO_SET_0(data_to_gpio_map[i]);
+	}
+}
+
+// byte wide data bus: one GPSET0 + one GPCLR0 store per byte written, one GPLEV0 load per byte read
+unsigned int data_out_set[256];		// GPSET0 mask for each data byte
+unsigned int data_out_clr[256];		// GPCLR0 mask for each data byte
+unsigned char data_in_lane[4][256];	// GPLEV0 byte lane -> data bits it carries
+
+void init_data_bus(int map[8])
+{
+	int i, d;
+
+	memset(data_in_lane, 0, sizeof(data_in_lane));
+	for (d = 0; d < 256; d++) {
+		data_out_set[d] = data_out_clr[d] = 0;
+		for (i = 0; i < 8; i++) {
+			if (d & (1 << i))
+				data_out_set[d] |= 1u << map[i];
+			else
+				data_out_clr[d] |= 1u << map[i];
+			if (d & (1 << (map[i] % 8)))
+				data_in_lane[map[i] / 8][d] |= 1 << i;
+		}
+	}
+}
+
+inline int data8_in_table(void)
+{
+	unsigned int lev = *(gpio + 13);
+	return data_in_lane[0][lev & 0xff] | data_in_lane[1][(lev >> 8) & 0xff] |
+		data_in_lane[2][(lev >> 16) & 0xff] | data_in_lane[3][lev >> 24];
+}
+
+inline void data8_out_table(int data)
+{
+	*(gpio +  7) = data_out_set[data & 0xff];
+	*(gpio + 10) = data_out_clr[data & 0xff];
+}
+
+inline int GPIO_DATA8_IN(void)
+{
+#ifdef FAST_BUS
+	int data = data8_in_table();
+#else
+	int data = data8_in_bits();
+#endif
 #ifdef DEBUG
 	printf("GPIO_DATA8_IN: data=%02x\n", data);
 #endif
@@ -138,16 +195,14 @@ inline int GPIO_DATA8_IN(void)
 
 inline void GPIO_DATA8_OUT(int data)
 {
-	int i;
 #ifdef DEBUG
 	printf("GPIO_DATA8_OUT: data=%02x\n", data);
 #endif
-	for (i = 0; i < 8; i++, data >>= 1) {
-		if (data & 1)
-			GPIO_SET_1(data_to_gpio_map[i]);
-		else
-			GPIO_SET_0(data_to_gpio_map[i]);
-	}
+#ifdef FAST_BUS
+	data8_out_table(data);
+#else
+	data8_out_bits(data);
+#endif
 }
 
 int delay = 1;
@@ -186,6 +241,8 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	init_data_bus(data_to_gpio_map);
+
 	INP_GPIO(N_READ_BUSY);
 
 	OUT_GPIO(N_WRITE_PROTECT);
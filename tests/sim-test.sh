@@ -0,0 +1,124 @@
+#!/bin/sh
+# checks rpi-raw-nand-v3 against the simulated NAND (-B sim), no Pi nor chip needed:
+#   sh tests/sim-test.sh
+# builds into a temporary directory and prints one line per check, exit status 1 if any failed
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+g++ -O2 "$top/rpi-raw-nand-v3.c" -o v3 -lpthread || exit 1
+failed=0
+
+check()
+{
+	if [ "$2" = 0 ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		failed=1
+	fi
+}
+
+# run <log> <args>: the flasher on the simulator, progress lines split at \r
+run()
+{
+	log=$1
+	shift
+	./v3 -k "$top/nand-chips.txt" "$@" 2>&1 | tr '\r' '\n' > "$log"
+}
+
+# bus_time <log>: virtual seconds the simulator counted
+bus_time()
+{
+	sed -n 's/^Simulator: *\([0-9.]*\) s of bus time.*/\1/p' "$1"
+}
+
+# less <a> <b>: 0 when a < b
+less()
+{
+	awk -v a="$1" -v b="$2" 'BEGIN { exit !(a != "" && b != "" && a + 0 < b + 0) }'
+}
+
+printf 'image nand.bin\nseed 1\n' > sim.txt
+printf 'image nand.bin\nseed 1\nnocache\n' > nocache.txt
+printf 'seed 1\n' > erased.txt
+head -c $((128 * 2112)) /dev/urandom > image.bin
+
+run write.log -B sim:sim.txt 100% write_full 0 128 image.bin
+run plain.log -B sim:sim.txt 100% read_full 0 128 plain.bin
+cmp -s image.bin plain.bin
+check "write_full, read_full give the image back" $?
+
+# a plain <timing> was a spin loop count before it became a percent, old scripts have to fail
+run plain-timing.log -B sim:sim.txt 50 read_full 0 1 plain-timing.bin
+grep -q "a plain number was the spin loop delay" plain-timing.log && [ ! -e plain-timing.bin ]
+check "a plain number as <timing> is refused" $?
+
+# parameter pages: 256 bytes for ONFI, 512 for JEDEC, each with its CRC in its last two bytes
+for kind in onfi jedec; do
+	printf 'geometry 4096 224 64 512\n%s\n' $kind > $kind.txt
+	run $kind.log -B sim:$kind.txt 100% read_id
+	grep -qi "^$kind parameter page: SIMULATED" $kind.log && grep -q "^Page geometry: *4096 + 224" $kind.log
+	check "read_id takes the geometry from the $kind parameter page" $?
+done
+
+# small page chips take other commands, they have to be refused rather than misaddressed
+printf 'id AD 73 00 00 00\ngeometry 512 16 32 1024\n' > small.txt
+run small.log -B sim:small.txt 100% read_full 0 1 small.bin
+grep -q "small page chip.*not supported" small.log && [ ! -e small.bin ]
+check "a small page chip is refused" $?
+
+# cache read (-c): same data, tR of page N + 1 overlaps clocking out page N
+run cache.log -c -B sim:sim.txt 100% read_full 0 128 cache.bin
+grep -q "^Cache read (31h/3Fh) works" cache.log && cmp -s image.bin cache.bin
+check "-c read_full gives the image back with cache reads" $?
+less "$(bus_time cache.log)" "$(bus_time plain.log)"
+check "-c read_full takes less bus time ($(bus_time cache.log) s) than page by page ($(bus_time plain.log) s)" $?
+
+# a chip without a cache register fails the probe, reads page by page
+run nocache.log -c -B sim:nocache.txt 100% read_full 0 128 nocache.bin
+grep -q "^Cache read (31h/3Fh) does not give the same data" nocache.log && cmp -s image.bin nocache.bin
+check "-c read_full falls back on a chip without cache read" $?
+
+# an erased block has no two different pages to tell a working cache read from an ignored one
+run erased.log -c -B sim:erased.txt 100% read_full 0 64 erased.bin
+grep -q "^Cache read (31h/3Fh) can't be checked" erased.log
+check "-c read_full of an erased block reads page by page" $?
+
+# calibrate on a chip that only meets timing mode 2, with mode 5 timings on the host: the bisection
+# has to stop at the sim's threshold, the fastest timing with no violation, and save a slower one
+printf 'image slow.bin\nseed 1\nmode 2\n' > slow.txt
+head -c $((4 * 2112)) image.bin > slow-image.bin
+run slow-write.log -B sim:slow.txt 200% write_full 0 4 slow-image.bin
+run calibrate.log -m 5 -B sim:slow.txt 200% calibrate 0 4 timing.txt
+fastest=$(sed -n 's/^Fastest stable timing: \([0-9]*\)%.*/\1/p' calibrate.log)
+run fastest.log -m 5 -B sim:slow.txt "${fastest:-0}%" read_full 0 4 fastest.bin
+run below.log -m 5 -B sim:slow.txt $((${fastest:-0} - 1))% read_full 0 4 below.bin
+grep -q "violations: none" fastest.log && ! grep -q "violations: none" below.log
+check "calibrate finds the sim's threshold (${fastest:-none}%: clean, one less: violations)" $?
+run saved.log -m 5 -B sim:slow.txt timing.txt read_full 0 4 saved.bin
+[ "$(cat timing.txt)" -gt "${fastest:-0}" ] && grep -q "violations: none" saved.log && cmp -s slow-image.bin saved.bin
+check "the saved timing ($(cat timing.txt)%) reads clean" $?
+
+# a chip that hangs busy mid-run: read_full stops at the timeout and keeps the pages it read
+printf 'image nand.bin\nseed 1\nhang 100\n' > hang.txt
+run hang.log -B sim:hang.txt 100% read_full 0 128 hang.bin
+size=$(stat -c %s hang.bin 2>/dev/null || echo 0)
+grep -q "^Timeout:" hang.log && [ "$size" -gt 0 ] && [ $((size % 2112)) = 0 ] && [ "$size" -lt $((128 * 2112)) ] &&
+	cmp -s -n "$size" hang.bin image.bin
+check "read_full on a hung chip keeps the $((size / 2112)) pages read before the timeout" $?
+
+# multi-plane pairs with page retries, under AddressSanitizer where the compiler has it: a retried
+# odd block page must stay within its slot of the pair buffer
+if g++ -O1 -fsanitize=address "$top/rpi-raw-nand-v3.c" -o v3-asan -lpthread 2>/dev/null; then
+	printf 'id EC F1 00 95 44\nimage planes.bin\nseed 1\nweak 4 30\n' > planes.txt
+	run planes-write.log -B sim:planes.txt 100% write_full 0 128 image.bin
+	ASAN_OPTIONS=detect_leaks=0 ./v3-asan -k "$top/nand-chips.txt" -p -B sim:planes.txt 100% read_full 0 128 planes.bin \
+		> planes.log 2>&1
+	[ $? = 0 ] && ! grep -q "ERROR: AddressSanitizer" planes.log
+	check "-p read_full with page retries stays within its buffers" $?
+fi
+
+exit $failed